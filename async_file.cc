@@ -0,0 +1,427 @@
+#include "async_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+#ifdef __linux__
+#  include <linux/io_uring.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#endif
+
+namespace xx {
+#ifdef __linux__
+class IoRing;
+static thread_local const IoRing* xReaper = NULL;   // ring reaped by this thread
+
+/*
+ * io_uring with one reaper thread. The submission queue is filled under a
+ * mutex. The thread that finds no flush in progress enters the kernel for
+ * all entries queued so far, others just leave their entries to it.
+ */
+class IoRing {
+  public:
+    explicit IoRing(IoService* io)
+        : _io(io), _fd(-1), _sq(NULL), _cq(NULL), _sqes(NULL),
+          _pending(0), _unsubmitted(0), _flushing(false), _stop(false),
+          _space(false, false), _t(this, &IoRing::Reap) {
+    }
+
+    ~IoRing();
+
+    // return false if io_uring is not available
+    bool Init(uint32 entries);
+
+    // op == NULL: a nop to wake up the reaper
+    void Submit(IoOp* op);
+
+    // wait for operations in flight, and join the reaper
+    void Stop();
+
+  private:
+    IoService* _io;
+    int _fd;
+    struct io_uring_params _p;
+
+    void* _sq;
+    void* _cq;
+    ::size_t _sq_size;
+    ::size_t _cq_size;
+    struct io_uring_sqe* _sqes;
+
+    uint32* _sq_tail;
+    uint32* _sq_mask;
+    uint32* _sq_array;
+    uint32* _cq_head;
+    uint32* _cq_tail;
+    uint32* _cq_mask;
+    struct io_uring_cqe* _cqes;
+
+    Mutex _mutex;
+    uint32 _pending;           // submitted, not reaped
+    uint32 _unsubmitted;       // queued, not passed to the kernel
+    bool _flushing;
+    bool _stop;
+    SyncEvent _space;
+    Thread _t;
+
+    int Enter(uint32 to_submit, uint32 min_complete, uint32 flags) {
+        return static_cast<int>(::syscall(__NR_io_uring_enter, _fd, to_submit,
+                                          min_complete, flags, NULL, 0));
+    }
+
+    void Flush();
+    void Reap();
+};
+
+IoRing::~IoRing() {
+    if (_sqes != NULL) ::munmap(_sqes, _p.sq_entries * sizeof(struct io_uring_sqe));
+    if (_cq != NULL && _cq != _sq) ::munmap(_cq, _cq_size);
+    if (_sq != NULL) ::munmap(_sq, _sq_size);
+    if (_fd >= 0) ::close(_fd);
+}
+
+bool IoRing::Init(uint32 entries) {
+    memset(&_p, 0, sizeof(_p));
+    _fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &_p));
+    if (_fd < 0) return false;
+
+    _sq_size = _p.sq_off.array + _p.sq_entries * sizeof(uint32);
+    _cq_size = _p.cq_off.cqes + _p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (_p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) _sq_size = _cq_size = std::max(_sq_size, _cq_size);
+
+    void* p = ::mmap(NULL, _sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     _fd, IORING_OFF_SQ_RING);
+    if (p == MAP_FAILED) return false;
+    _sq = p;
+
+    if (single) {
+        _cq = _sq;
+    } else {
+        p = ::mmap(NULL, _cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   _fd, IORING_OFF_CQ_RING);
+        if (p == MAP_FAILED) return false;
+        _cq = p;
+    }
+
+    p = ::mmap(NULL, _p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+    if (p == MAP_FAILED) return false;
+    _sqes = static_cast<struct io_uring_sqe*>(p);
+
+    char* sq = static_cast<char*>(_sq);
+    _sq_tail = reinterpret_cast<uint32*>(sq + _p.sq_off.tail);
+    _sq_mask = reinterpret_cast<uint32*>(sq + _p.sq_off.ring_mask);
+    _sq_array = reinterpret_cast<uint32*>(sq + _p.sq_off.array);
+
+    char* cq = static_cast<char*>(_cq);
+    _cq_head = reinterpret_cast<uint32*>(cq + _p.cq_off.head);
+    _cq_tail = reinterpret_cast<uint32*>(cq + _p.cq_off.tail);
+    _cq_mask = reinterpret_cast<uint32*>(cq + _p.cq_off.ring_mask);
+    _cqes = reinterpret_cast<struct io_uring_cqe*>(cq + _p.cq_off.cqes);
+
+    return _t.Start();
+}
+
+void IoRing::Submit(IoOp* op) {
+    bool flush;
+    {
+        ScopedMutex m(_mutex);
+
+        // keep completions within the cq ring. the reaper can't wait for
+        // itself: a completion submitting the next op may go beyond
+        // sq_entries, as the cq ring has twice the entries.
+        while (_pending >= _p.sq_entries) {
+            if (xReaper == this) {
+                CHECK_LT(_pending, _p.cq_entries);
+                CHECK_LT(_unsubmitted, _p.sq_entries);
+                break;
+            }
+            _mutex.UnLock();
+            _space.TimedWait(1);
+            _mutex.Lock();
+        }
+
+        uint32 tail = *_sq_tail;
+        uint32 i = tail & *_sq_mask;
+        struct io_uring_sqe* sqe = &_sqes[i];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = reinterpret_cast<uintptr_t>(op);
+
+        if (op == NULL) {
+            sqe->opcode = IORING_OP_NOP;
+        } else if (op->op == IO_FSYNC) {
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd = op->fd;
+            if (op->datasync) sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        } else {
+            sqe->opcode = op->op == IO_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+            sqe->fd = op->fd;
+            sqe->addr = reinterpret_cast<uintptr_t>(&op->iov);
+            sqe->len = 1;
+            sqe->off = op->off;
+        }
+
+        _sq_array[i] = i;
+        __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        ++_pending;
+        ++_unsubmitted;
+        flush = !_flushing;
+        if (flush) _flushing = true;
+    }
+
+    if (flush) this->Flush();
+}
+
+// submit queued entries, until no more are queued during the syscall
+void IoRing::Flush() {
+    while (true) {
+        uint32 n;
+        {
+            ScopedMutex m(_mutex);
+            n = _unsubmitted;
+            if (n == 0) {
+                _flushing = false;
+                return;
+            }
+        }
+
+        while (n > 0) {
+            int r = this->Enter(n, 0, 0);
+            if (r > 0) {
+                n -= r;
+                ScopedMutex m(_mutex);
+                _unsubmitted -= r;
+                continue;
+            }
+
+            if (r < 0) {
+                CHECK(errno == EINTR || errno == EAGAIN || errno == EBUSY);
+                if (errno == EINTR) continue;
+            }
+
+            // nothing submitted, the kernel is short of cq space or memory.
+            // wait for a completion, and for the reaper to free cq entries,
+            // instead of spinning on the syscall.
+            this->Enter(0, 1, IORING_ENTER_GETEVENTS);
+            _space.TimedWait(1);
+        }
+    }
+}
+
+void IoRing::Reap() {
+    xReaper = this;
+
+    while (true) {
+        {
+            ScopedMutex m(_mutex);
+            if (_stop && _pending == 0) return;
+        }
+
+        if (this->Enter(0, 1, IORING_ENTER_GETEVENTS) < 0) {
+            CHECK(errno == EINTR || errno == EAGAIN || errno == EBUSY);
+        }
+
+        uint32 head = *_cq_head;
+        uint32 tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+
+        // free the space before running completions, which may submit
+        while (head != tail) {
+            IoOp* ops[32];
+            int64 res[32];
+            uint32 n = 0;
+            for (; head != tail && n < 32; ++head, ++n) {
+                struct io_uring_cqe* cqe = &_cqes[head & *_cq_mask];
+                ops[n] = reinterpret_cast<IoOp*>(static_cast<uintptr_t>(cqe->user_data));
+                res[n] = cqe->res;
+            }
+            __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+
+            {
+                ScopedMutex m(_mutex);
+                _pending -= n;
+            }
+            _space.Notify();
+
+            for (uint32 i = 0; i < n; ++i) {
+                if (ops[i] != NULL) _io->Complete(ops[i], res[i]);
+            }
+        }
+    }
+}
+
+void IoRing::Stop() {
+    {
+        ScopedMutex m(_mutex);
+        _stop = true;
+    }
+
+    this->Submit(NULL);
+    _t.Join();
+}
+
+#else // no io_uring
+class IoRing {
+  public:
+    explicit IoRing(IoService*) {
+    }
+
+    bool Init(uint32) {
+        return false;
+    }
+
+    void Submit(IoOp*) {
+    }
+
+    void Stop() {
+    }
+};
+#endif
+
+// completes a future
+class IoPromise : public Closure {
+  public:
+    IoPromise()
+        : res(0) {
+    }
+
+    virtual ~IoPromise() {
+    }
+
+    virtual void Run() {
+        Promise<int64> p = promise;
+        int64 r = res;
+        delete this;
+        p.SetValue(r);
+    }
+
+    Promise<int64> promise;
+    int64 res;
+};
+} // namespace xx
+
+IoService::IoService(uint32 entries, uint32 nthreads, Executor* e)
+    : _entries(entries), _nthreads(nthreads), _executor(e), _started(false) {
+}
+
+IoService::~IoService() {
+    this->Stop();
+}
+
+bool IoService::Start(bool use_uring) {
+    if (_started) return true;
+
+    if (use_uring) {
+        _ring.reset(new xx::IoRing(this));
+        if (!_ring->Init(_entries)) _ring.reset();
+    }
+
+    if (_ring == NULL) {
+        _pool.reset(new ThreadPool(_nthreads));
+        if (!_pool->Start()) return false;
+    }
+
+    _started = true;
+    return true;
+}
+
+void IoService::Stop() {
+    if (!_started) return;
+    _started = false;
+
+    if (_ring != NULL) {
+        _ring->Stop();
+        _ring.reset();
+    } else {
+        _pool->Stop();
+        _pool.reset();
+    }
+}
+
+void IoService::Submit(const xx::IoOp& op) {
+    CHECK(_started);
+    xx::IoOp* x = new xx::IoOp(op);
+    _inflight.Inc();
+
+    if (_ring != NULL) {
+        _ring->Submit(x);
+    } else {
+        _pool->Post(NewCallback(this, &IoService::RunBlocking, x));
+    }
+}
+
+void IoService::Complete(xx::IoOp* op, int64 res) {
+    *op->res = res;
+    Closure* c = op->done;
+    delete op;
+
+    if (_executor != NULL) {
+        _executor->Post(c);
+    } else {
+        c->Run();
+    }
+    _inflight.Dec();
+}
+
+void IoService::RunBlocking(xx::IoOp* op) {
+    ssize_t r;
+    do {
+        if (op->op == xx::IO_READ) {
+            r = ::pread(op->fd, op->iov.iov_base, op->iov.iov_len, op->off);
+        } else if (op->op == xx::IO_WRITE) {
+            r = ::pwrite(op->fd, op->iov.iov_base, op->iov.iov_len, op->off);
+        } else {
+#ifdef __APPLE__
+            r = ::fsync(op->fd);
+#else
+            r = op->datasync ? ::fdatasync(op->fd) : ::fsync(op->fd);
+#endif
+        }
+    } while (r < 0 && errno == EINTR);
+
+    this->Complete(op, r < 0 ? -errno : r);
+}
+
+AsyncFile::~AsyncFile() {
+    if (_owned) this->Close();
+}
+
+bool AsyncFile::Open(const std::string& path, int flags, int mode) {
+    if (_owned) this->Close();
+    _fd = ::open(path.c_str(), flags | O_CLOEXEC, mode);
+    _owned = _fd >= 0;
+    return _owned;
+}
+
+void AsyncFile::Close() {
+    if (_fd >= 0) ::close(_fd);
+    _fd = -1;
+    _owned = false;
+}
+
+void AsyncFile::Submit(int op, void* buf, uint32 n, uint64 off, bool datasync,
+                       int64* res, Closure* done) {
+    xx::IoOp x;
+    x.op = op;
+    x.fd = _fd;
+    x.iov.iov_base = buf;
+    x.iov.iov_len = n;
+    x.off = off;
+    x.datasync = datasync;
+    x.res = res;
+    x.done = done;
+    _io->Submit(x);
+}
+
+Future<int64> AsyncFile::Submit(int op, void* buf, uint32 n, uint64 off,
+                                bool datasync) {
+    xx::IoPromise* p = new xx::IoPromise;
+    Future<int64> f = p->promise.GetFuture();
+    this->Submit(op, buf, n, off, datasync, &p->res, p);
+    return f;
+}
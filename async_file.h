@@ -0,0 +1,171 @@
+#pragma once
+
+#include "data_types.h"
+#include "atomic.h"
+#include "closure.h"
+#include "executor.h"
+#include "future.h"
+#include "scoped_ptr.h"
+#include "thread_pool.h"
+#include "thread_util.h"
+
+#include <sys/uio.h>
+#include <string>
+
+/*
+ * IoService: runs file reads, writes and fsyncs without blocking the caller.
+ *
+ *   On linux it uses io_uring (raw syscalls, no liburing). Submissions from
+ *   threads arriving at the same time go to the kernel in one io_uring_enter(),
+ *   and one reaper thread takes completions. Where io_uring is not available
+ *   (old kernels, seccomp), operations run on a pool of blocking threads.
+ *
+ *   Completion closures run in the reaper (or pool) thread, or are posted to
+ *   the executor if one is given. They must not block, but may submit the
+ *   next operation: in the reaper, up to twice the ring entries may be in
+ *   flight, beyond that it is a fatal error.
+ *
+ *   IoService io;
+ *   io.Start();
+ *
+ *   AsyncFile f(&io);
+ *   f.Open("/tmp/x", O_RDWR | O_CREAT);
+ *
+ *   int64 res;                    // bytes done, or -errno
+ *   f.Read(buf, 4096, 0, &res, NewCallback(&OnRead, &res));
+ *
+ *   Future<int64> w = f.Write(buf, 4096, 0);
+ *   Future<int64> s = f.Fsync();
+ *   s.Get();
+ *
+ *   io.Stop();                    // wait for operations in flight
+ */
+namespace xx {
+struct IoOp {
+    int op;                    // IO_READ, IO_WRITE, IO_FSYNC
+    int fd;
+    struct iovec iov;
+    uint64 off;
+    bool datasync;
+    int64* res;
+    Closure* done;
+};
+
+enum {
+    IO_READ = 0,
+    IO_WRITE = 1,
+    IO_FSYNC = 2,
+};
+
+class IoRing;
+} // namespace xx
+
+class IoService {
+  public:
+    /*
+     * entries:  queue depth of io_uring
+     * nthreads: threads of the fallback pool
+     * e:        where completion closures run, NULL for the reaper thread
+     */
+    explicit IoService(uint32 entries = 256, uint32 nthreads = 4,
+                       Executor* e = NULL);
+
+    // call Stop()
+    ~IoService();
+
+    // use_uring == false: always use the thread pool
+    bool Start(bool use_uring = true);
+
+    // wait for operations in flight, no new operation is allowed.
+    void Stop();
+
+    // true if io_uring is in use
+    bool uring() const {
+        return _ring != NULL;
+    }
+
+    // number of operations submitted but not completed
+    uint32 inflight() {
+        return _inflight.value();
+    }
+
+    // *res = bytes done, or -errno; then done->Run()
+    void Submit(const xx::IoOp& op);
+
+  private:
+    const uint32 _entries;
+    const uint32 _nthreads;
+    Executor* _executor;
+    bool _started;
+    atomic_t _inflight;
+
+    scoped_ptr<xx::IoRing> _ring;
+    scoped_ptr<ThreadPool> _pool;
+
+    void Complete(xx::IoOp* op, int64 res);
+    void RunBlocking(xx::IoOp* op);
+
+    friend class xx::IoRing;
+
+    DISALLOW_COPY_AND_ASSIGN(IoService);
+};
+
+/*
+ * AsyncFile: a file for IoService. buffers must stay valid until the
+ * operation completes.
+ */
+class AsyncFile {
+  public:
+    // fd: an opened file, not closed by AsyncFile
+    explicit AsyncFile(IoService* io, int fd = -1)
+        : _io(io), _fd(fd), _owned(false) {
+    }
+
+    // close the file if it is opened by Open()
+    ~AsyncFile();
+
+    // flags and mode as for open(2)
+    bool Open(const std::string& path, int flags, int mode = 0644);
+
+    void Close();
+
+    int fd() const {
+        return _fd;
+    }
+
+    void Read(void* buf, uint32 n, uint64 off, int64* res, Closure* done) {
+        this->Submit(xx::IO_READ, buf, n, off, false, res, done);
+    }
+
+    void Write(const void* buf, uint32 n, uint64 off, int64* res, Closure* done) {
+        this->Submit(xx::IO_WRITE, const_cast<void*>(buf), n, off, false, res, done);
+    }
+
+    void Fsync(int64* res, Closure* done, bool datasync = false) {
+        this->Submit(xx::IO_FSYNC, NULL, 0, 0, datasync, res, done);
+    }
+
+    Future<int64> Read(void* buf, uint32 n, uint64 off) {
+        return this->Submit(xx::IO_READ, buf, n, off, false);
+    }
+
+    Future<int64> Write(const void* buf, uint32 n, uint64 off) {
+        return this->Submit(xx::IO_WRITE, const_cast<void*>(buf), n, off, false);
+    }
+
+    Future<int64> Fsync(bool datasync = false) {
+        return this->Submit(xx::IO_FSYNC, NULL, 0, 0, datasync);
+    }
+
+  private:
+    IoService* _io;
+    int _fd;
+    bool _owned;
+
+    void Submit(int op, void* buf, uint32 n, uint64 off, bool datasync,
+                int64* res, Closure* done);
+
+    Future<int64> Submit(int op, void* buf, uint32 n, uint64 off, bool datasync);
+
+    DISALLOW_COPY_AND_ASSIGN(AsyncFile);
+};
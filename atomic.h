@@ -10,6 +10,10 @@
 #  include <intrin.h>
 #endif
 
+#include <stddef.h>
+#include <atomic>
+#include <type_traits>
+
 /*
  * atomic_t
  *
@@ -145,3 +149,160 @@ class atomic_t {
     DISALLOW_COPY_AND_ASSIGN(atomic_t);
 };
 #endif // _WIN32
+
+/*
+ * Atomic<T>: atomic integral, pointer or small trivially copyable value,
+ * with explicit memory order.
+ *
+ *  @Load, Store                     default to MO_SEQ_CST
+ *
+ *  @FetchAdd, FetchSub, FetchAnd,
+ *   FetchOr, FetchXor, Exchange     return original value
+ *
+ *  @CompareExchangeWeak/Strong      as std::atomic: return true if swapped,
+ *                                   or store the current value to *expected.
+ *                                   the weak one may fail spuriously.
+ *
+ *  @CompareSwap                     return true if swapped, as atomic_t
+ *
+ *  @Inc, Dec, Add                   return new value, as atomic_t
+ *
+ *   Atomic<uint64> bytes;
+ *   bytes.FetchAdd(n, MO_RELAXED);  // statistics, no fence
+ *
+ *   Atomic<Node*> head;
+ *   node->next = head.Load(MO_RELAXED);
+ *   while (!head.CompareExchangeWeak(&node->next, node, MO_RELEASE));
+ */
+enum MemoryOrder {
+    MO_RELAXED,
+    MO_ACQUIRE,
+    MO_RELEASE,
+    MO_ACQ_REL,
+    MO_SEQ_CST,
+};
+
+namespace xx {
+inline std::memory_order StdOrder(MemoryOrder mo) {
+    static const std::memory_order kOrders[] = {
+        std::memory_order_relaxed, std::memory_order_acquire,
+        std::memory_order_release, std::memory_order_acq_rel,
+        std::memory_order_seq_cst,
+    };
+    return kOrders[mo];
+}
+
+// the failure order of compare exchange can not be release
+inline std::memory_order FailureOrder(MemoryOrder mo) {
+    if (mo == MO_ACQ_REL) return std::memory_order_acquire;
+    if (mo == MO_RELEASE) return std::memory_order_relaxed;
+    return StdOrder(mo);
+}
+
+// argument of FetchAdd/FetchSub: ptrdiff_t for pointers
+template<typename T>
+struct AtomicDiff {
+    typedef T type;
+};
+
+template<typename T>
+struct AtomicDiff<T*> {
+    typedef ::ptrdiff_t type;
+};
+} // namespace xx
+
+inline void AtomicFence(MemoryOrder mo = MO_SEQ_CST) {
+    std::atomic_thread_fence(xx::StdOrder(mo));
+}
+
+template<typename T>
+class Atomic {
+  public:
+    typedef typename xx::AtomicDiff<T>::type diff_t;
+
+    explicit Atomic(T v = T())
+        : _v(v) {
+    }
+
+    ~Atomic() {
+    }
+
+    T Load(MemoryOrder mo = MO_SEQ_CST) const {
+        return _v.load(xx::StdOrder(mo));
+    }
+
+    void Store(T v, MemoryOrder mo = MO_SEQ_CST) {
+        _v.store(v, xx::StdOrder(mo));
+    }
+
+    T value() const {
+        return this->Load();
+    }
+
+    T Exchange(T v, MemoryOrder mo = MO_SEQ_CST) {
+        return _v.exchange(v, xx::StdOrder(mo));
+    }
+
+    // for loops that retry anyway, cheaper than the strong one on ll/sc cpus
+    bool CompareExchangeWeak(T* expected, T desired, MemoryOrder mo = MO_SEQ_CST) {
+        return _v.compare_exchange_weak(*expected, desired, xx::StdOrder(mo),
+                                        xx::FailureOrder(mo));
+    }
+
+    bool CompareExchangeStrong(T* expected, T desired, MemoryOrder mo = MO_SEQ_CST) {
+        return _v.compare_exchange_strong(*expected, desired, xx::StdOrder(mo),
+                                          xx::FailureOrder(mo));
+    }
+
+    // return true if swapped, as atomic_t
+    bool CompareSwap(T oldv, T newv, MemoryOrder mo = MO_SEQ_CST) {
+        return _v.compare_exchange_strong(oldv, newv, xx::StdOrder(mo),
+                                          xx::FailureOrder(mo));
+    }
+
+    // integral and pointer types only
+    T FetchAdd(diff_t v, MemoryOrder mo = MO_SEQ_CST) {
+        return _v.fetch_add(v, xx::StdOrder(mo));
+    }
+
+    T FetchSub(diff_t v, MemoryOrder mo = MO_SEQ_CST) {
+        return _v.fetch_sub(v, xx::StdOrder(mo));
+    }
+
+    T Inc(MemoryOrder mo = MO_SEQ_CST) {
+        return this->Add(1, mo);
+    }
+
+    T Dec(MemoryOrder mo = MO_SEQ_CST) {
+        return this->Add(-1, mo);
+    }
+
+    T Add(diff_t v, MemoryOrder mo = MO_SEQ_CST) {
+        return _v.fetch_add(v, xx::StdOrder(mo)) + v;
+    }
+
+    // integral types only
+    T FetchAnd(T v, MemoryOrder mo = MO_SEQ_CST) {
+        return _v.fetch_and(v, xx::StdOrder(mo));
+    }
+
+    T FetchOr(T v, MemoryOrder mo = MO_SEQ_CST) {
+        return _v.fetch_or(v, xx::StdOrder(mo));
+    }
+
+    T FetchXor(T v, MemoryOrder mo = MO_SEQ_CST) {
+        return _v.fetch_xor(v, xx::StdOrder(mo));
+    }
+
+    bool lock_free() const {
+        return _v.is_lock_free();
+    }
+
+  private:
+    static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+    static_assert(sizeof(T) <= sizeof(uint64), "T must be at most 8 bytes");
+
+    std::atomic<T> _v;
+
+    DISALLOW_COPY_AND_ASSIGN(Atomic);
+};
@@ -0,0 +1,206 @@
+#include "cpu_topology.h"
+#include "string_split.h"
+
+#include <stdlib.h>
+#include <fstream>
+#include <map>
+#include <set>
+
+#ifndef _WIN32
+#  include <unistd.h>
+#else
+#  include <windows.h>
+#endif
+
+static bool ReadLine(const std::string& path, std::string* line) {
+    std::ifstream ifs(path.c_str());
+    if (!ifs || !std::getline(ifs, *line)) return false;
+    TrimString(*line);
+    return true;
+}
+
+static int ReadInt(const std::string& path, int def) {
+    std::string line;
+    if (!ReadLine(path, &line) || line.empty()) return def;
+    return ::atoi(line.c_str());
+}
+
+static bool ToInt(const std::string& s, int* v) {
+    if (s.empty()) return false;
+
+    char* end = NULL;
+    long x = ::strtol(s.c_str(), &end, 10);
+    if (*end != '\0' || x < 0) return false;
+
+    *v = static_cast<int>(x);
+    return true;
+}
+
+bool ParseCpuList(const std::string& s, std::vector<int>* v) {
+    std::vector<std::string> ranges;
+    SplitString(s, ',', ranges);
+
+    for (::size_t i = 0; i < ranges.size(); ++i) {
+        std::string& r = ranges[i];
+        TrimString(r);
+
+        ::size_t pos = r.find('-');
+        int from, to;
+        if (pos == std::string::npos) {
+            if (!ToInt(r, &from)) return false;
+            to = from;
+        } else {
+            if (!ToInt(r.substr(0, pos), &from)) return false;
+            if (!ToInt(r.substr(pos + 1), &to) || to < from) return false;
+        }
+
+        for (int c = from; c <= to; ++c) {
+            v->push_back(c);
+        }
+    }
+
+    return true;
+}
+
+std::vector<int> NumaNodeCpus(int node) {
+    std::vector<int> v;
+    std::string line;
+    std::string path = "/sys/devices/system/node/node" + std::to_string(node) +
+        "/cpulist";
+
+    if (!ReadLine(path, &line) || !ParseCpuList(line, &v)) v.clear();
+    return v;
+}
+
+std::vector<int> CpuTopology::AllowedCpus() {
+    std::vector<int> v;
+    std::ifstream ifs("/proc/self/status");
+    std::string line;
+
+    while (std::getline(ifs, line)) {
+        if (line.compare(0, 18, "Cpus_allowed_list:") != 0) continue;
+        if (!ParseCpuList(line.substr(18), &v)) v.clear();
+        break;
+    }
+
+    return v;
+}
+
+static int OnlineCpuNum() {
+#ifndef _WIN32
+    long n = ::sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? static_cast<int>(n) : 1;
+#else
+    ::SYSTEM_INFO info;
+    ::GetSystemInfo(&info);
+    return static_cast<int>(info.dwNumberOfProcessors);
+#endif
+}
+
+static int AllowedCpuNum() {
+    int n = static_cast<int>(CpuTopology::AllowedCpus().size());
+    return n > 0 ? n : OnlineCpuNum();
+}
+
+int CpuTopology::AvailableCpuNum() {
+    static int kNum = AllowedCpuNum();   // thread safe since C++11
+    return kNum;
+}
+
+bool CpuTopology::Load() {
+    std::string line;
+    std::vector<int> online;
+    if (!ReadLine("/sys/devices/system/cpu/online", &line)) return false;
+    if (!ParseCpuList(line, &online) || online.empty()) return false;
+
+    // cpu ==> numa node
+    std::map<int, int> nodes;
+    std::vector<int> node_ids;
+    if (ReadLine("/sys/devices/system/node/online", &line) &&
+        ParseCpuList(line, &node_ids)) {
+        for (::size_t i = 0; i < node_ids.size(); ++i) {
+            std::vector<int> v = NumaNodeCpus(node_ids[i]);
+            for (::size_t k = 0; k < v.size(); ++k) {
+                nodes[v[k]] = node_ids[i];
+            }
+        }
+    }
+
+    _cpus.clear();
+    std::map<std::pair<int, int>, int> cores;   // <socket, core_id> ==> core
+    std::set<int> sockets;
+
+    for (::size_t i = 0; i < online.size(); ++i) {
+        std::string dir = "/sys/devices/system/cpu/cpu" +
+            std::to_string(online[i]) + "/topology/";
+
+        CpuInfo info;
+        info.cpu = online[i];
+        info.socket = ReadInt(dir + "physical_package_id", 0);
+
+        int core_id = ReadInt(dir + "core_id", info.cpu);
+        std::pair<int, int> key(info.socket, core_id);
+        if (cores.find(key) == cores.end()) {
+            int n = static_cast<int>(cores.size());
+            cores[key] = n;
+        }
+        info.core = cores[key];
+
+        std::map<int, int>::iterator it = nodes.find(info.cpu);
+        info.numa_node = it != nodes.end() ? it->second : -1;
+
+        sockets.insert(info.socket);
+        _cpus.push_back(info);
+    }
+
+    _ncores = static_cast<int>(cores.size());
+    _nsockets = static_cast<int>(sockets.size());
+    _nnodes = static_cast<int>(node_ids.size());
+    return true;
+}
+
+const CpuInfo* CpuTopology::Find(int cpu) const {
+    for (::size_t i = 0; i < _cpus.size(); ++i) {
+        if (_cpus[i].cpu == cpu) return &_cpus[i];
+    }
+    return NULL;
+}
+
+std::vector<int> CpuTopology::Siblings(int cpu) const {
+    const CpuInfo* info = this->Find(cpu);
+    if (info == NULL) return std::vector<int>();
+    return this->CpusOfCore(info->core);
+}
+
+std::vector<int> CpuTopology::CpusOfCore(int core) const {
+    std::vector<int> v;
+    for (::size_t i = 0; i < _cpus.size(); ++i) {
+        if (_cpus[i].core == core) v.push_back(_cpus[i].cpu);
+    }
+    return v;
+}
+
+std::vector<int> CpuTopology::CpusOfSocket(int socket) const {
+    std::vector<int> v;
+    for (::size_t i = 0; i < _cpus.size(); ++i) {
+        if (_cpus[i].socket == socket) v.push_back(_cpus[i].cpu);
+    }
+    return v;
+}
+
+std::vector<int> CpuTopology::CpusOfNode(int node) const {
+    std::vector<int> v;
+    for (::size_t i = 0; i < _cpus.size(); ++i) {
+        if (_cpus[i].numa_node == node) v.push_back(_cpus[i].cpu);
+    }
+    return v;
+}
+
+std::vector<int> CpuTopology::PhysicalCpus() const {
+    std::vector<int> v;
+    std::set<int> seen;
+    for (::size_t i = 0; i < _cpus.size(); ++i) {
+        if (seen.insert(_cpus[i].core).second) v.push_back(_cpus[i].cpu);
+    }
+    return v;
+}
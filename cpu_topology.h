@@ -0,0 +1,92 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/*
+ * parse a cpu list of linux sysfs, return false if s is invalid.
+ *
+ *   ParseCpuList("0-3,8,10-11", &v)  ==>  0 1 2 3 8 10 11
+ */
+bool ParseCpuList(const std::string& s, std::vector<int>* v);
+
+// logical cpus of a numa node, empty if unknown
+std::vector<int> NumaNodeCpus(int node);
+
+struct CpuInfo {
+    int cpu;            // logical cpu id
+    int core;           // physical core, unique in the system
+    int socket;         // physical package id
+    int numa_node;      // -1 if unknown
+};
+
+/*
+ * CpuTopology: logical cpus, cores, sockets and numa nodes from
+ * /sys/devices/system. Load() fails on systems without sysfs.
+ *
+ *   CpuTopology topo;
+ *   if (topo.Load()) {
+ *       std::vector<int> v = topo.CpusOfSocket(0);
+ *       ThreadOptions opt;
+ *       opt.cpus = topo.Siblings(v[0]);     // a core and its SMT siblings
+ *   }
+ */
+class CpuTopology {
+  public:
+    CpuTopology()
+        : _ncores(0), _nsockets(0), _nnodes(0) {
+    }
+    ~CpuTopology() {
+    }
+
+    bool Load();
+
+    const std::vector<CpuInfo>& cpus() const {
+        return _cpus;
+    }
+
+    int cpu_num() const {
+        return static_cast<int>(_cpus.size());
+    }
+
+    int core_num() const {
+        return _ncores;
+    }
+
+    int socket_num() const {
+        return _nsockets;
+    }
+
+    int numa_node_num() const {
+        return _nnodes;
+    }
+
+    // NULL if cpu is not online
+    const CpuInfo* Find(int cpu) const;
+
+    // logical cpus sharing the same core with cpu, cpu included
+    std::vector<int> Siblings(int cpu) const;
+
+    std::vector<int> CpusOfCore(int core) const;
+    std::vector<int> CpusOfSocket(int socket) const;
+    std::vector<int> CpusOfNode(int node) const;
+
+    // the first logical cpu of every physical core, one thread per core
+    std::vector<int> PhysicalCpus() const;
+
+    /*
+     * cpus the process may run on (Cpus_allowed_list of /proc/self/status),
+     * empty if unknown. Taskset or cgroup cpusets may leave out online cpus.
+     */
+    static std::vector<int> AllowedCpus();
+
+    // number of cpus the process may run on, at least 1, read once.
+    // default number of threads or shards of ThreadPool, EventLoopGroup...
+    static int AvailableCpuNum();
+
+  private:
+    std::vector<CpuInfo> _cpus;    // sorted by cpu id
+    int _ncores;
+    int _nsockets;
+    int _nnodes;
+};
@@ -12,6 +12,9 @@ typedef ::uint16_t uint16;
 typedef ::uint32_t uint32;
 typedef ::uint64_t uint64;
 
+// size of a cache line, for padding data shared by threads
+#define CACHE_LINE_SIZE 64
+
 #define DISALLOW_COPY_AND_ASSIGN(Type) \
     Type(const Type&); \
     void operator=(const Type&)
@@ -0,0 +1,131 @@
+#include "epoch.h"
+#include "time_util.h"
+
+#ifdef __linux__
+#  include <linux/membarrier.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
+
+// retired objects of a thread before trying to free them
+static const uint32 kRetireBatch = 64;
+
+#ifdef __linux__
+static bool RegisterMembarrier() {
+    long cmds = ::syscall(__NR_membarrier, MEMBARRIER_CMD_QUERY, 0);
+    if (cmds < 0 || !(cmds & MEMBARRIER_CMD_PRIVATE_EXPEDITED)) return false;
+    return ::syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+}
+
+// a full fence on every running thread of the process
+static inline void HeavyFence() {
+    CHECK_EQ(::syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0), 0);
+}
+#else
+static bool RegisterMembarrier() {
+    return false;
+}
+
+static inline void HeavyFence() {
+}
+#endif
+
+namespace xx {
+EpochRecord::~EpochRecord() {
+    if (domain != NULL && !retired.empty()) {
+        ScopedMutex m(domain->_mutex);
+        domain->_orphans.insert(domain->_orphans.end(), retired.begin(), retired.end());
+    }
+}
+} // namespace xx
+
+EpochDomain::EpochDomain()
+    : _epoch(1) {
+    static bool kMembarrier = RegisterMembarrier();
+    _membarrier = kMembarrier;
+    _records.reset(new ThreadLocal<xx::EpochRecord>);
+}
+
+EpochDomain::~EpochDomain() {
+    _records.reset();    // records hand retired objects over to _orphans
+
+    for (::size_t i = 0; i < _orphans.size(); ++i) {
+        _orphans[i].free(_orphans[i].p);
+    }
+}
+
+EpochDomain* DefaultEpochDomain() {
+    static EpochDomain* kDomain = new EpochDomain;
+    return kDomain;
+}
+
+void EpochDomain::Retire(void* p, void (*f)(void*)) {
+    xx::EpochRecord* r = _records->get();
+    r->domain = this;
+
+    xx::Retired x = { p, f, __atomic_load_n(&_epoch, __ATOMIC_ACQUIRE) };
+    r->retired.push_back(x);
+
+    if (r->retired.size() >= kRetireBatch) {
+        this->TryAdvance();
+        this->Collect(&r->retired);
+    }
+}
+
+/*
+ * the heavy fence pairs with the compiler barrier in Enter(): a reader not
+ * seen active here will see the unlinked pointers in its critical section.
+ */
+bool EpochDomain::TryAdvance() {
+    if (_membarrier) {
+        HeavyFence();
+    } else {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+
+    uint64 e = __atomic_load_n(&_epoch, __ATOMIC_ACQUIRE);
+    bool ok = true;
+    _records->ForEach([&](xx::EpochRecord* r) {
+        uint64 x = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE);
+        if (x != 0 && x != e) ok = false;
+    });
+
+    if (!ok) return false;
+    __atomic_compare_exchange_n(&_epoch, &e, e + 1, false,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return true;
+}
+
+void EpochDomain::Collect(std::deque<xx::Retired>* q) {
+    uint64 e = __atomic_load_n(&_epoch, __ATOMIC_ACQUIRE);
+    while (!q->empty() && q->front().epoch + 2 <= e) {
+        xx::Retired x = q->front();
+        q->pop_front();
+        x.free(x.p);
+    }
+
+    std::deque<xx::Retired> v;
+    {
+        ScopedMutex m(_mutex);
+        while (!_orphans.empty() && _orphans.front().epoch + 2 <= e) {
+            v.push_back(_orphans.front());
+            _orphans.pop_front();
+        }
+    }
+
+    for (::size_t i = 0; i < v.size(); ++i) {
+        v[i].free(v[i].p);
+    }
+}
+
+void EpochDomain::Synchronize() {
+    xx::EpochRecord* r = _records->get();
+    CHECK(r->nest == 0);
+
+    uint64 e = __atomic_load_n(&_epoch, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&_epoch, __ATOMIC_ACQUIRE) < e + 2) {
+        if (!this->TryAdvance()) SleepInUs(50);
+    }
+
+    this->Collect(&r->retired);
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include "data_types.h"
+#include "ref_counting.h"
+#include "scoped_ptr.h"
+#include "thread_local.h"
+#include "thread_util.h"
+
+#include <deque>
+
+/*
+ * EpochDomain: epoch based reclamation, for data read far more often than
+ * written, e.g. routing tables or config snapshots.
+ *
+ *   Readers wrap accesses in Enter()/Leave() (or ScopedEpoch), which only
+ *   store to a slot of the calling thread, no atomic instruction and no
+ *   shared cache line. A writer publishes a new version, and retires the old
+ *   one. A retired object is freed after every reader that might still see
+ *   it has left, that is after the global epoch has advanced twice.
+ *
+ *   On linux the ordering between readers and writers is done by the
+ *   membarrier() syscall on the writer side, readers use no fence at all.
+ *   Without membarrier, readers do one fence in Enter().
+ *
+ *   EpochDomain* d = DefaultEpochDomain();
+ *
+ *   // reader
+ *   {
+ *       ScopedEpoch e(d);
+ *       Table* t = __atomic_load_n(&xTable, __ATOMIC_ACQUIRE);
+ *       t->Lookup(key);           // t is not freed before e goes out of scope
+ *   }
+ *
+ *   // writer
+ *   Table* old = __atomic_exchange_n(&xTable, new_table, __ATOMIC_ACQ_REL);
+ *   d->Retire(old);               // delete old later
+ *   d->RetireRef(old_ref);        // or unref() a RefCounted later
+ *   d->Synchronize();             // or wait for readers now
+ *
+ *   Retired objects are freed in batches, by threads calling Retire(). A
+ *   thread must not wait for another reader inside a critical section.
+ */
+class EpochDomain;
+
+namespace xx {
+struct Retired {
+    void* p;
+    void (*free)(void*);
+    uint64 epoch;              // global epoch when retired
+};
+
+// state of one thread in one domain
+struct EpochRecord {
+    EpochRecord()
+        : epoch(0), nest(0), domain(NULL) {
+    }
+
+    // hand retired objects over to the domain
+    ~EpochRecord();
+
+    uint64 epoch;              // epoch when entered, 0 if not in critical section
+    uint32 nest;               // Enter() may be nested
+    char pad[CACHE_LINE_SIZE - sizeof(uint64) - sizeof(uint32)];
+
+    EpochDomain* domain;       // set by Retire()
+    std::deque<Retired> retired;
+};
+
+template<typename T>
+inline void DeleteObject(void* p) {
+    delete static_cast<T*>(p);
+}
+
+inline void UnrefObject(void* p) {
+    static_cast<RefCounted*>(p)->unref();
+}
+} // namespace xx
+
+class EpochDomain {
+  public:
+    EpochDomain();
+
+    // free all retired objects, no reader may be active
+    ~EpochDomain();
+
+    void Enter() {
+        xx::EpochRecord* r = _records->get();
+        if (r->nest++ == 0) {
+            __atomic_store_n(&r->epoch, __atomic_load_n(&_epoch, __ATOMIC_RELAXED),
+                             __ATOMIC_RELAXED);
+
+            // loads in the critical section must not move up before the store
+            if (_membarrier) {
+                __atomic_signal_fence(__ATOMIC_SEQ_CST);
+            } else {
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            }
+        }
+    }
+
+    void Leave() {
+        xx::EpochRecord* r = _records->get();
+        if (--r->nest == 0) __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+    }
+
+    // free p by f(p) when no reader can see it, p must be unreachable already
+    void Retire(void* p, void (*f)(void*));
+
+    template<typename T>
+    void Retire(T* p) {
+        this->Retire(p, &xx::DeleteObject<T>);
+    }
+
+    // p->unref() when no reader can see it
+    void RetireRef(RefCounted* p) {
+        this->Retire(p, &xx::UnrefObject);
+    }
+
+    /*
+     * wait until readers in critical sections entered before the call have
+     * left, and free what can be freed. don't call it in a critical section.
+     */
+    void Synchronize();
+
+    uint64 epoch() {
+        return __atomic_load_n(&_epoch, __ATOMIC_ACQUIRE);
+    }
+
+  private:
+    uint64 _epoch;
+    char _pad[CACHE_LINE_SIZE - sizeof(uint64)];
+
+    bool _membarrier;                          // readers need no fence
+    scoped_ptr<ThreadLocal<xx::EpochRecord> > _records;
+
+    Mutex _mutex;
+    std::deque<xx::Retired> _orphans;          // from threads exited
+
+    // advance the epoch if all active readers have seen the current one
+    bool TryAdvance();
+
+    // free objects retired two epochs ago
+    void Collect(std::deque<xx::Retired>* q);
+
+    friend struct xx::EpochRecord;
+
+    DISALLOW_COPY_AND_ASSIGN(EpochDomain);
+};
+
+// shared domain, never deleted
+EpochDomain* DefaultEpochDomain();
+
+class ScopedEpoch {
+  public:
+    explicit ScopedEpoch(EpochDomain* d)
+        : _d(d) {
+        _d->Enter();
+    }
+
+    ~ScopedEpoch() {
+        _d->Leave();
+    }
+
+  private:
+    EpochDomain* _d;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedEpoch);
+};
@@ -0,0 +1,361 @@
+#include "event_loop.h"
+
+#ifdef __linux__
+
+#include "cpu_topology.h"
+#include "time_util.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+static thread_local const EventLoop* xLoop = NULL;   // loop of the current thread
+
+EventLoop::EventLoop()
+    : _t(this, &EventLoop::Loop), _started(false), _revents(0),
+      _timer_id(0), _armed(0) {
+    _epfd = epoll_create1(EPOLL_CLOEXEC);
+    CHECK_GE(_epfd, 0);
+
+    _evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    CHECK_GE(_evfd, 0);
+
+    _tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    CHECK_GE(_tfd, 0);
+
+    // data.ptr NULL for the eventfd, &_tfd for the timerfd
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    CHECK_EQ(epoll_ctl(_epfd, EPOLL_CTL_ADD, _evfd, &ev), 0);
+
+    ev.data.ptr = &_tfd;
+    CHECK_EQ(epoll_ctl(_epfd, EPOLL_CTL_ADD, _tfd, &ev), 0);
+}
+
+EventLoop::~EventLoop() {
+    this->Stop();
+
+    std::unordered_map<int, Handler*>::iterator it = _handlers.begin();
+    for (; it != _handlers.end(); ++it) {
+        _removed.push_back(it->second);
+    }
+    for (::size_t i = 0; i < _removed.size(); ++i) {
+        delete _removed[i]->c;
+        delete _removed[i];
+    }
+
+    std::unordered_map<uint64, Timer*>::iterator x = _timers.begin();
+    for (; x != _timers.end(); ++x) {
+        delete x->second->c;
+        delete x->second;
+    }
+
+    ::close(_tfd);
+    ::close(_evfd);
+    ::close(_epfd);
+}
+
+bool EventLoop::Start() {
+    if (_started) return true;
+    _started = _t.Start();
+    return _started;
+}
+
+bool EventLoop::Start(const ThreadOptions& options) {
+    if (_started) return true;
+    _started = _t.Start(options);
+    return _started;
+}
+
+void EventLoop::Stop() {
+    if (!_started) return;
+
+    // joining the current thread would never return
+    if (this->InLoop()) {
+        _stop.CompareSwap(0, 1);
+        return;
+    }
+
+    if (_stop.CompareSwap(0, 2) || _stop.CompareSwap(1, 2)) {
+        this->Wake();
+        _t.Join();
+        _started = false;
+        this->RunPosted();
+    }
+}
+
+bool EventLoop::Add(int fd, uint32 events, Closure* c) {
+    Handler* h = new Handler;
+    h->fd = fd;
+    h->c = c;
+    h->removed = false;
+
+    ScopedMutex m(_mutex);
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = h;
+    if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        delete h;
+        return false;
+    }
+
+    _handlers[fd] = h;
+    return true;
+}
+
+bool EventLoop::Modify(int fd, uint32 events) {
+    ScopedMutex m(_mutex);
+    std::unordered_map<int, Handler*>::iterator it = _handlers.find(fd);
+    if (it == _handlers.end()) return false;
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = it->second;
+    return epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void EventLoop::Remove(int fd) {
+    ScopedMutex m(_mutex);
+    std::unordered_map<int, Handler*>::iterator it = _handlers.find(fd);
+    if (it == _handlers.end()) return;
+
+    epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, NULL);
+    __atomic_store_n(&it->second->removed, true, __ATOMIC_RELAXED);
+    _removed.push_back(it->second);
+    _handlers.erase(it);
+}
+
+bool EventLoop::InLoop() const {
+    return xLoop == this;
+}
+
+void EventLoop::Wake() {
+    if (_wakeup.CompareSwap(0, 1)) {
+        uint64 x = 1;
+        ssize_t r = ::write(_evfd, &x, sizeof(x));
+        (void) r;
+    }
+}
+
+void EventLoop::Post(Closure* c) {
+    bool empty;
+    {
+        ScopedMutex m(_mutex);
+        empty = _posted.empty();
+        _posted.push_back(c);
+    }
+
+    if (empty && !this->InLoop()) this->Wake();
+}
+
+void EventLoop::RunPosted() {
+    std::vector<Closure*> v;
+    {
+        ScopedMutex m(_mutex);
+        v.swap(_posted);
+    }
+
+    for (::size_t i = 0; i < v.size(); ++i) {
+        v[i]->Run();
+    }
+}
+
+uint64 EventLoop::NewTimer(uint32 ms, uint32 interval, Closure* c) {
+    Timer* t = new Timer;
+    t->expire = NowInUs() + static_cast<uint64>(ms) * 1000;
+    t->interval = interval;
+    t->running = false;
+    t->cancelled = false;
+    t->c = c;
+
+    uint64 id;
+    bool earliest;
+    {
+        ScopedMutex m(_mutex);
+        id = ++_timer_id;
+        _timers[id] = t;
+        _expire.insert(std::make_pair(t->expire, id));
+        earliest = _armed == 0 || t->expire < _armed;
+        if (earliest) this->ArmTimer();
+    }
+
+    return id;
+}
+
+bool EventLoop::Cancel(uint64 id) {
+    Timer* t;
+    {
+        ScopedMutex m(_mutex);
+        std::unordered_map<uint64, Timer*>::iterator it = _timers.find(id);
+        if (it == _timers.end()) return false;
+
+        t = it->second;
+        if (t->running) {
+            // periodic timer being run, RunTimers() will delete it
+            t->cancelled = true;
+            return true;
+        }
+
+        _expire.erase(std::make_pair(t->expire, id));
+        _timers.erase(it);
+    }
+
+    delete t->c;
+    delete t;
+    return true;
+}
+
+// arm _tfd for the earliest timer, with _mutex held
+void EventLoop::ArmTimer() {
+    uint64 expire = _expire.empty() ? 0 : _expire.begin()->first;
+    if (expire == _armed) return;
+    _armed = expire;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = expire / 1000000;
+    its.it_value.tv_nsec = expire % 1000000 * 1000;
+    CHECK_EQ(timerfd_settime(_tfd, TFD_TIMER_ABSTIME, &its, NULL), 0);
+}
+
+void EventLoop::RunTimers() {
+    uint64 x;
+    ssize_t r = ::read(_tfd, &x, sizeof(x));
+    (void) r;
+
+    uint64 now = NowInUs();
+    while (true) {
+        Timer* t;
+        uint64 id;
+        {
+            ScopedMutex m(_mutex);
+            if (_expire.empty() || _expire.begin()->first > now) {
+                _armed = 0;
+                this->ArmTimer();
+                return;
+            }
+
+            id = _expire.begin()->second;
+            _expire.erase(_expire.begin());
+            t = _timers[id];
+            if (t->interval == 0) {
+                _timers.erase(id);
+            } else {
+                t->running = true;
+            }
+        }
+
+        if (t->interval == 0) {
+            t->c->Run();    // NewCallback() deletes itself
+            delete t;
+            continue;
+        }
+
+        t->c->Run();
+
+        ScopedMutex m(_mutex);
+        t->running = false;
+        if (t->cancelled) {
+            _timers.erase(id);
+            delete t->c;
+            delete t;
+        } else {
+            t->expire = now + static_cast<uint64>(t->interval) * 1000;
+            _expire.insert(std::make_pair(t->expire, id));
+        }
+    }
+}
+
+void EventLoop::Loop() {
+    xLoop = this;
+    struct epoll_event events[256];
+
+    while (_stop.value() == 0) {
+        // closures posted by the loop itself don't wake it up, poll instead
+        // of sleeping until they are run.
+        bool posted;
+        {
+            ScopedMutex m(_mutex);
+            posted = !_posted.empty();
+        }
+
+        int n = epoll_wait(_epfd, events, 256, posted ? 0 : -1);
+        if (n < 0) {
+            CHECK_EQ(errno, EINTR);
+            continue;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            void* p = events[i].data.ptr;
+            if (p == NULL) {
+                uint64 x;
+                ssize_t r = ::read(_evfd, &x, sizeof(x));
+                (void) r;
+                _wakeup.CompareSwap(1, 0);
+                this->RunPosted();
+            } else if (p == &_tfd) {
+                this->RunTimers();
+            } else {
+                Handler* h = static_cast<Handler*>(p);
+                // removed by an earlier callback, or another thread. h is
+                // deleted by this thread after dispatching.
+                if (__atomic_load_n(&h->removed, __ATOMIC_RELAXED)) continue;
+                _revents = events[i].events;
+                h->c->Run();
+            }
+        }
+
+        // closures they post are run in the next round
+        this->RunPosted();
+
+        std::vector<Handler*> v;
+        {
+            ScopedMutex m(_mutex);
+            v.swap(_removed);
+        }
+        for (::size_t i = 0; i < v.size(); ++i) {
+            delete v[i]->c;
+            delete v[i];
+        }
+    }
+
+    xLoop = NULL;
+}
+
+EventLoopGroup::EventLoopGroup(uint32 n, bool pin) {
+    if (pin) _cpus = CpuTopology::AllowedCpus();
+    if (n == 0) n = static_cast<uint32>(CpuTopology::AvailableCpuNum());
+
+    for (uint32 i = 0; i < n; ++i) {
+        _loops.push_back(new EventLoop);
+    }
+}
+
+EventLoopGroup::~EventLoopGroup() {
+    this->Stop();
+    for (::size_t i = 0; i < _loops.size(); ++i) {
+        delete _loops[i];
+    }
+}
+
+bool EventLoopGroup::Start() {
+    for (::size_t i = 0; i < _loops.size(); ++i) {
+        ThreadOptions opt;
+        opt.name = "event-loop";
+        if (!_cpus.empty()) opt.cpus.push_back(_cpus[i % _cpus.size()]);
+        if (!_loops[i]->Start(opt)) return false;
+    }
+    return true;
+}
+
+void EventLoopGroup::Stop() {
+    for (::size_t i = 0; i < _loops.size(); ++i) {
+        _loops[i]->Stop();
+    }
+}
+
+#endif // __linux__
@@ -0,0 +1,178 @@
+#pragma once
+
+/*
+ * EventLoop: an epoll loop in its own thread, linux only.
+ *
+ *   Fd callbacks run in the loop thread when the fd is ready. Timers are kept
+ *   in a sorted set, and one timerfd is armed for the earliest. Closures
+ *   posted from other threads are queued, and an eventfd wakes up the loop
+ *   only if the queue was empty.
+ *
+ *   Ownership of closures:
+ *     Add:             c is run whenever fd is ready. create it with
+ *                      NewPermanentCallback(), the loop deletes it after
+ *                      Remove(), or in the destructor.
+ *     RunAfter:        like TimerWheel::RunAfter().
+ *     RunEvery:        like TimerWheel::RunEvery().
+ *     Post:            the loop does not delete c, see executor.h.
+ *
+ *   EventLoop loop;
+ *   loop.Start();
+ *   loop.Add(fd, EPOLLIN, NewPermanentCallback(&conn, &Conn::OnReadable));
+ *   loop.RunAfter(100, NewCallback(&fun));
+ *   loop.Post(NewCallback(&fun));
+ *   loop.Remove(fd);
+ *   loop.Stop();
+ *
+ *   EventLoopGroup g;        // one loop per cpu, each pinned to its cpu
+ *   g.Start();
+ *   g.Next()->Add(fd, EPOLLIN, c);
+ */
+#ifdef __linux__
+
+#include "data_types.h"
+#include "atomic.h"
+#include "closure.h"
+#include "executor.h"
+#include "thread_util.h"
+
+#include <sys/epoll.h>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class EventLoop : public Executor {
+  public:
+    EventLoop();
+
+    // call Stop(), and delete closures of fds and timers.
+    virtual ~EventLoop();
+
+    bool Start();
+    bool Start(const ThreadOptions& options);
+
+    /*
+     * run closures already posted, then join the loop thread. Called in a
+     * callback of the loop, it only makes the loop quit once the callback
+     * returns: a later Stop(), or the destructor, joins the thread.
+     */
+    void Stop();
+
+    /*
+     * events: EPOLLIN, EPOLLOUT, EPOLLET... return false if epoll_ctl fails.
+     * in c, revents() tells which events are ready.
+     */
+    bool Add(int fd, uint32 events, Closure* c);
+
+    bool Modify(int fd, uint32 events);
+
+    // c of fd is deleted in the loop thread, it may still run if the loop is
+    // dispatching events of fd in another thread.
+    void Remove(int fd);
+
+    // events of the fd whose callback is running, in the loop thread only
+    uint32 revents() const {
+        return _revents;
+    }
+
+    // return id of the timer, 0 is never used.
+    uint64 RunAfter(uint32 ms, Closure* c) {
+        return this->NewTimer(ms, 0, c);
+    }
+
+    // ms == 0 runs c every 1ms, as TimerWheel runs it every tick
+    uint64 RunEvery(uint32 ms, Closure* c) {
+        if (ms == 0) ms = 1;
+        return this->NewTimer(ms, ms, c);
+    }
+
+    // return false if the timer is not found, or a one-shot timer has fired.
+    bool Cancel(uint64 id);
+
+    using Executor::Post;
+    virtual void Post(Closure* c);
+
+    bool InLoop() const;
+
+  private:
+    struct Handler {
+        int fd;
+        Closure* c;
+        bool removed;          // set by Remove() in any thread, atomic access
+    };
+
+    struct Timer {
+        uint64 expire;         // in monotonic us
+        uint32 interval;       // in ms, 0 for one-shot timers
+        bool running;
+        bool cancelled;
+        Closure* c;
+    };
+
+    int _epfd;
+    int _evfd;                 // eventfd for Post()
+    int _tfd;                  // timerfd for the earliest timer
+    Thread _t;
+    bool _started;
+    atomic_t _stop;            // 1: quit, asked in the loop, 2: joining
+    uint32 _revents;
+
+    Mutex _mutex;
+    std::unordered_map<int, Handler*> _handlers;
+    std::vector<Handler*> _removed;            // deleted after dispatching
+
+    std::vector<Closure*> _posted;
+    atomic_t _wakeup;                          // eventfd written, not read yet
+
+    uint64 _timer_id;
+    std::unordered_map<uint64, Timer*> _timers;
+    std::set<std::pair<uint64, uint64> > _expire;   // (expire, id)
+    uint64 _armed;                                  // expire time of _tfd
+
+    void Loop();
+    void Wake();
+    void RunPosted();
+    void RunTimers();
+    void ArmTimer();
+    uint64 NewTimer(uint32 ms, uint32 interval, Closure* c);
+
+    DISALLOW_COPY_AND_ASSIGN(EventLoop);
+};
+
+/*
+ * EventLoopGroup: n loops, by default one per cpu the process may run on.
+ * With pin == true, loop i runs on cpu i of the allowed cpus.
+ */
+class EventLoopGroup {
+  public:
+    explicit EventLoopGroup(uint32 n = 0, bool pin = true);
+
+    ~EventLoopGroup();
+
+    bool Start();
+
+    void Stop();
+
+    uint32 size() const {
+        return static_cast<uint32>(_loops.size());
+    }
+
+    EventLoop* at(uint32 i) const {
+        return _loops[i];
+    }
+
+    // loops in round robin
+    EventLoop* Next() {
+        return _loops[(_next.Inc() - 1) % _loops.size()];
+    }
+
+  private:
+    std::vector<EventLoop*> _loops;
+    std::vector<int> _cpus;
+    atomic_t _next;
+
+    DISALLOW_COPY_AND_ASSIGN(EventLoopGroup);
+};
+
+#endif // __linux__
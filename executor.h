@@ -0,0 +1,34 @@
+#pragma once
+
+#include "closure.h"
+
+/*
+ * Executor: anything that runs closures somewhere.
+ *
+ *   Closures created by NewCallback() delete themselves after Run(), while
+ *   those created by NewPermanentCallback() are still owned by the caller.
+ *   An executor never deletes a closure on its own.
+ */
+class Executor {
+  public:
+    Executor() {
+    }
+    virtual ~Executor() {
+    }
+
+    virtual void Post(Closure* c) = 0;
+
+    template<typename ... A>
+    void Post(void (*f)(A ...), A ... a) {
+        this->Post(NewCallback(f, a...));
+    }
+
+    template<typename T, typename ... A>
+    void Post(T* obj, void (T::*f)(A ...), A ... a) {
+        this->Post(NewCallback(obj, f, a...));
+    }
+
+  private:
+    Executor(const Executor&);
+    void operator=(const Executor&);
+};
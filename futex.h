@@ -0,0 +1,55 @@
+#pragma once
+
+#include "data_types.h"
+
+/*
+ * futex: wait on a 32-bit word in user space, the kernel is entered only to
+ * sleep or to wake up sleepers. linux only, private to the process.
+ *
+ *   FutexWait(&w, v);            // sleep if w == v, until woken up
+ *   FutexWake(&w, 1);            // wake up one thread sleeping on w
+ *   FutexRequeue(&w, v, 1, &m);  // wake up one, move the others to m
+ */
+#ifdef __linux__
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+namespace xx {
+/*
+ * sleep while *addr == v, at most us microseconds if us > 0.
+ * return false on timeout. may return true spuriously, callers recheck.
+ */
+inline bool FutexWait(uint32* addr, uint32 v, uint64 us = 0) {
+    struct timespec ts;
+    struct timespec* p = NULL;
+    if (us > 0) {
+        ts.tv_sec = static_cast<time_t>(us / 1000000);
+        ts.tv_nsec = static_cast<long>(us % 1000000 * 1000);
+        p = &ts;
+    }
+
+    if (::syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, v, p, NULL, 0) == 0) {
+        return true;
+    }
+    return errno != ETIMEDOUT;
+}
+
+// wake up at most n threads sleeping on addr, return number woken up
+inline int FutexWake(uint32* addr, int n) {
+    return static_cast<int>(::syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n,
+                                      NULL, NULL, 0));
+}
+/*
+ * if *addr == v, wake up at most n threads sleeping on addr, and move the
+ * rest of them to sleep on addr2 instead.
+ * return false if *addr != v.
+ */
+inline bool FutexRequeue(uint32* addr, uint32 v, int n, uint32* addr2) {
+    return ::syscall(SYS_futex, addr, FUTEX_CMP_REQUEUE_PRIVATE, n,
+                     static_cast<long>(0x7fffffff), addr2, v) >= 0;
+}
+} // namespace xx
+#endif
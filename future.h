@@ -0,0 +1,719 @@
+#pragma once
+
+#include "data_types.h"
+#include "atomic.h"
+#include "closure.h"
+#include "executor.h"
+#include "ref_counting.h"
+#include "scoped_ptr.h"
+#include "thread_util.h"
+
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+ * Future & Promise
+ *
+ *   A Promise sets the value once, and all Futures of it see the value.
+ *   Continuations added by Then() run when the value is set: inline in the
+ *   thread that sets the value (or at once if it is already set), or posted to
+ *   an executor. No thread is blocked for a pending future unless Get() or
+ *   Wait() is called.
+ *
+ *   int add(int a, int b) { return a + b; }
+ *
+ *   Future<int> f = Async(&pool, &add, 1, 2);
+ *   Future<std::string> s = f.Then([](int v) { return std::to_string(v); });
+ *   s.Get();                                  // "3"
+ *
+ *   std::vector<Future<int> > v;
+ *   v.push_back(Async(&pool, &add, 1, 2));
+ *   v.push_back(Async(&pool, &add, 3, 4));
+ *   WhenAll(v).Then([](std::vector<int>& r) { ... }, &pool);
+ *   WhenAny(v).Get();                         // <index, value> of the first one
+ *
+ *   Future<void> and Promise<void> carry no value. A promise destroyed without
+ *   setting the value leaves its futures pending forever, and continuations
+ *   of them are deleted without being run once the futures are gone.
+ */
+template<typename T> class Future;
+template<typename T> class Promise;
+
+namespace xx {
+/*
+ * state shared by a promise and its futures
+ */
+class FutureStateBase : public RefCounted {
+  public:
+    bool ready() {
+        ScopedMutex m(_mutex);
+        return _ready;
+    }
+
+    void Wait() {
+        SyncEvent* ev = this->Event();
+        if (ev != NULL) ev->Wait();
+    }
+
+    // return false if timeout
+    bool TimedWait(uint32 ms) {
+        SyncEvent* ev = this->Event();
+        return ev == NULL || ev->TimedWait(ms);
+    }
+
+    // c is run at once if the value is already set
+    void AddCallback(Closure* c) {
+        {
+            ScopedMutex m(_mutex);
+            if (!_ready) {
+                _callbacks.push_back(c);
+                return;
+            }
+        }
+        c->Run();
+    }
+
+  protected:
+    FutureStateBase()
+        : _ready(false) {
+    }
+
+    // callbacks not run, the value was never set. they hold no reference
+    // of this state.
+    virtual ~FutureStateBase() {
+        for (::size_t i = 0; i < _callbacks.size(); ++i) {
+            delete _callbacks[i];
+        }
+    }
+
+    // return false if the value has been set. otherwise, store the value by
+    // store->Run() with the mutex locked, and run the callbacks out of it.
+    bool SetReady(Closure* store) {
+        std::vector<Closure*> callbacks;
+        {
+            ScopedMutex m(_mutex);
+            if (_ready) return false;
+
+            if (store != NULL) store->Run();
+            _ready = true;
+            _callbacks.swap(callbacks);
+            if (_ev != NULL) _ev->Notify();
+        }
+
+        for (::size_t i = 0; i < callbacks.size(); ++i) {
+            callbacks[i]->Run();
+        }
+        return true;
+    }
+
+  private:
+    Mutex _mutex;
+    bool _ready;
+    std::vector<Closure*> _callbacks;
+    scoped_ptr<SyncEvent> _ev;   // created by the first waiter
+
+    // NULL if ready
+    SyncEvent* Event() {
+        ScopedMutex m(_mutex);
+        if (_ready) return NULL;
+        if (_ev == NULL) _ev.reset(new SyncEvent(true, false));
+        return _ev.get();
+    }
+};
+
+template<typename T>
+class FutureState : public FutureStateBase {
+  public:
+    FutureState()
+        : _v(NULL) {
+    }
+
+    virtual ~FutureState() {
+        if (_v != NULL) _v->~T();
+    }
+
+    bool Set(const T& v) {
+        Store store(this, v);
+        return this->SetReady(&store);
+    }
+
+    // valid only when ready
+    T& value() {
+        return *_v;
+    }
+
+  private:
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type _storage;
+    T* _v;
+
+    // copy the value into the state
+    class Store : public Closure {
+      public:
+        Store(FutureState* s, const T& v)
+            : _s(s), _v(v) {
+        }
+
+        virtual void Run() {
+            _s->_v = new (&_s->_storage) T(_v);
+        }
+
+      private:
+        FutureState* _s;
+        const T& _v;
+    };
+};
+
+template<>
+class FutureState<void> : public FutureStateBase {
+  public:
+    FutureState() {
+    }
+
+    virtual ~FutureState() {
+    }
+
+    bool Set() {
+        return this->SetReady(NULL);
+    }
+};
+
+/*
+ * holds a reference of the state, and unref() it in destructor
+ */
+template<typename S>
+class StateRef {
+  public:
+    explicit StateRef(S* s = NULL)
+        : _s(s) {
+    }
+
+    StateRef(const StateRef& o)
+        : _s(o._s) {
+        if (_s != NULL) _s->ref();
+    }
+
+    ~StateRef() {
+        if (_s != NULL) _s->unref();
+    }
+
+    StateRef& operator=(const StateRef& o) {
+        if (o._s != NULL) o._s->ref();
+        if (_s != NULL) _s->unref();
+        _s = o._s;
+        return *this;
+    }
+
+    S* get() const {
+        return _s;
+    }
+
+    S* operator->() const {
+        DCHECK(_s != NULL);
+        return _s;
+    }
+
+    // hold s, a reference of it has been taken
+    void reset(S* s = NULL) {
+        if (_s != NULL) _s->unref();
+        _s = s;
+    }
+
+  private:
+    S* _s;
+};
+
+// set the promise with the result of f(v...)
+template<typename R>
+struct Setter {
+    template<typename P, typename F, typename ... V>
+    static void Run(P& p, F& f, V& ... v) {
+        p.SetValue(f(v...));
+    }
+};
+
+template<>
+struct Setter<void> {
+    template<typename P, typename F, typename ... V>
+    static void Run(P& p, F& f, V& ... v) {
+        f(v...);
+        p.SetValue();
+    }
+};
+
+// type of f(a...), std::result_of is gone in C++20
+template<typename F, typename ... A>
+struct CallResult {
+    typedef decltype(std::declval<F&>()(std::declval<A>()...)) type;
+};
+
+// type of f(value) for Future<T>::Then()
+template<typename F, typename T>
+struct ThenResult {
+    typedef typename CallResult<F, T&>::type type;
+};
+
+template<typename F>
+struct ThenResult<F, void> {
+    typedef typename CallResult<F>::type type;
+};
+
+// call f with the value of the state
+template<typename T>
+struct Caller {
+    template<typename R, typename F>
+    static void Run(Promise<R>& p, F& f, FutureState<T>* s) {
+        Setter<R>::Run(p, f, s->value());
+    }
+};
+
+template<>
+struct Caller<void> {
+    template<typename R, typename F>
+    static void Run(Promise<R>& p, F& f, FutureState<void>*) {
+        Setter<R>::Run(p, f);
+    }
+};
+
+/*
+ * continuation added by Then(). It posts itself to the executor if any,
+ * and is deleted after f is called.
+ *
+ * s keeps the callback until it is run, so no reference of s is taken before:
+ * that would be a cycle, never freed if the value is not set.
+ */
+template<typename T, typename F, typename R>
+class ThenCallback : public Closure {
+  public:
+    ThenCallback(FutureState<T>* s, const F& f, const Promise<R>& p,
+                 Executor* e)
+        : _s(s), _f(f), _p(p), _e(e) {
+    }
+
+    virtual ~ThenCallback() {
+    }
+
+    virtual void Run() {
+        if (_e != NULL) {
+            // s may be gone before the executor runs it
+            Executor* e = _e;
+            _e = NULL;
+            _s->ref();
+            _hold.reset(_s);
+            e->Post(this);
+            return;
+        }
+
+        Caller<T>::Run(_p, _f, _s);
+        delete this;
+    }
+
+  private:
+    FutureState<T>* _s;
+    StateRef<FutureState<T> > _hold;
+    F _f;
+    Promise<R> _p;
+    Executor* _e;
+};
+
+// run f() and set the promise with the result
+template<typename R, typename F>
+class AsyncCallback : public Closure {
+  public:
+    AsyncCallback(const F& f, const Promise<R>& p)
+        : _f(f), _p(p) {
+    }
+
+    virtual ~AsyncCallback() {
+    }
+
+    virtual void Run() {
+        Setter<R>::Run(_p, _f);
+        delete this;
+    }
+
+  private:
+    F _f;
+    Promise<R> _p;
+};
+
+// f(a...) as a functor
+template<typename R, typename ... A>
+struct FunctionCall {
+    FunctionCall(R (*f)(A ...), A ... a)
+        : _f(f), _a(a...) {
+    }
+
+    R operator()() {
+        return Apply<R>(_f, _a);
+    }
+
+    R (*_f)(A ...);
+    std::tuple<A...> _a;
+};
+
+// obj->f(a...) as a functor
+template<typename R, typename T, typename ... A>
+struct MethodCall {
+    MethodCall(T* obj, R (T::*f)(A ...), A ... a)
+        : _obj(obj), _f(f), _a(a...) {
+    }
+
+    R operator()() {
+        return Apply<R>(_obj, _f, _a);
+    }
+
+    T* _obj;
+    R (T::*_f)(A ...);
+    std::tuple<A...> _a;
+};
+
+template<typename T>
+class FutureBase {
+  public:
+    // false for a default constructed future
+    bool valid() const {
+        return _s.get() != NULL;
+    }
+
+    bool ready() const {
+        return _s->ready();
+    }
+
+    void Wait() const {
+        _s->Wait();
+    }
+
+    // return false if timeout
+    bool TimedWait(uint32 ms) const {
+        return _s->TimedWait(ms);
+    }
+
+    // run c when ready, or at once if ready already
+    void OnReady(Closure* c) const {
+        _s->AddCallback(c);
+    }
+
+    /*
+     * f(value), or f() for Future<void>, is called when ready. It is run in
+     * the thread that sets the value if e is NULL, otherwise posted to e.
+     * return future of the result of f.
+     */
+    template<typename F>
+    Future<typename ThenResult<F, T>::type> Then(F f, Executor* e = NULL) const {
+        typedef typename ThenResult<F, T>::type R;
+        Promise<R> p;
+        _s->AddCallback(new ThenCallback<T, F, R>(_s.get(), f, p, e));
+        return p.GetFuture();
+    }
+
+  protected:
+    FutureBase() {
+    }
+
+    // take a reference of s
+    explicit FutureBase(FutureState<T>* s)
+        : _s(s) {
+    }
+
+    FutureState<T>* state() const {
+        return _s.get();
+    }
+
+    StateRef<FutureState<T> > _s;
+
+    template<typename U, typename R>
+    friend Future<R> WhenAll(const std::vector<Future<U> >& v);
+
+    template<typename U, typename R>
+    friend Future<R> WhenAny(const std::vector<Future<U> >& v);
+};
+} // namespace xx
+
+template<typename T>
+class Future : public xx::FutureBase<T> {
+  public:
+    Future() {
+    }
+
+    // block until ready
+    T& Get() const {
+        this->Wait();
+        return this->_s->value();
+    }
+
+  private:
+    friend class Promise<T>;
+
+    explicit Future(xx::FutureState<T>* s)
+        : xx::FutureBase<T>(s) {
+    }
+};
+
+template<>
+class Future<void> : public xx::FutureBase<void> {
+  public:
+    Future() {
+    }
+
+    // block until ready
+    void Get() const {
+        this->Wait();
+    }
+
+  private:
+    friend class Promise<void>;
+
+    explicit Future(xx::FutureState<void>* s)
+        : xx::FutureBase<void>(s) {
+    }
+};
+
+template<typename T>
+class Promise {
+  public:
+    Promise()
+        : _s(new xx::FutureState<T>) {
+    }
+
+    Future<T> GetFuture() const {
+        _s->ref();
+        return Future<T>(_s.get());
+    }
+
+    // return false if the value has been set
+    bool SetValue(const T& v) {
+        return _s->Set(v);
+    }
+
+  private:
+    xx::StateRef<xx::FutureState<T> > _s;
+};
+
+template<>
+class Promise<void> {
+  public:
+    Promise()
+        : _s(new xx::FutureState<void>) {
+    }
+
+    Future<void> GetFuture() const {
+        _s->ref();
+        return Future<void>(_s.get());
+    }
+
+    // return false if the value has been set
+    bool SetValue() {
+        return _s->Set();
+    }
+
+  private:
+    xx::StateRef<xx::FutureState<void> > _s;
+};
+
+/*
+ * run f on the executor, or in the calling thread if e is NULL.
+ *
+ *   Future<int> a = Async(&pool, &add, 1, 2);
+ *   Future<int> b = Async(&pool, &obj, &T::hello, 7);
+ *   Future<int> c = Async(&pool, [&]() { return obj.hello(7); });
+ */
+template<typename F>
+inline Future<typename xx::CallResult<F>::type> Async(Executor* e, F f) {
+    typedef typename xx::CallResult<F>::type R;
+    Promise<R> p;
+    Closure* c = new xx::AsyncCallback<R, F>(f, p);
+    e != NULL ? e->Post(c) : c->Run();
+    return p.GetFuture();
+}
+
+template<typename R, typename ... A>
+inline Future<R> Async(Executor* e, R (*f)(A ...), A ... a) {
+    return Async(e, xx::FunctionCall<R, A...>(f, a...));
+}
+
+template<typename R, typename T, typename ... A>
+inline Future<R> Async(Executor* e, T* obj, R (T::*f)(A ...), A ... a) {
+    return Async(e, xx::MethodCall<R, T, A...>(obj, f, a...));
+}
+
+namespace xx {
+// states of the futures are kept by the callbacks when ready: holding them
+// before would be a cycle with the callbacks, as for ThenCallback.
+template<typename T>
+struct AllState : public RefCounted {
+    explicit AllState(const std::vector<Future<T> >& v)
+        : states(v.size()), left(static_cast<uint32>(v.size())) {
+    }
+
+    void Finish() {
+        std::vector<T> r;
+        r.reserve(states.size());
+        for (::size_t i = 0; i < states.size(); ++i) {
+            r.push_back(states[i]->value());
+        }
+        states.clear();
+        p.SetValue(r);
+    }
+
+    std::vector<StateRef<FutureState<T> > > states;
+    atomic_t left;
+    Promise<std::vector<T> > p;
+};
+
+template<>
+struct AllState<void> : public RefCounted {
+    explicit AllState(const std::vector<Future<void> >& v)
+        : left(static_cast<uint32>(v.size())) {
+    }
+
+    void Finish() {
+        p.SetValue();
+    }
+
+    atomic_t left;
+    Promise<void> p;
+};
+
+template<typename T>
+class AllCallback : public Closure {
+  public:
+    AllCallback(AllState<T>* s, ::size_t i, FutureState<T>* f)
+        : _s(s), _i(i), _f(f) {
+        s->ref();
+    }
+
+    virtual ~AllCallback() {
+    }
+
+    virtual void Run() {
+        _f->ref();
+        _s->states[_i].reset(_f);
+        if (_s->left.Dec() == 0) _s->Finish();
+        delete this;
+    }
+
+  private:
+    StateRef<AllState<T> > _s;
+    ::size_t _i;
+    FutureState<T>* _f;
+};
+
+template<>
+class AllCallback<void> : public Closure {
+  public:
+    AllCallback(AllState<void>* s, ::size_t, FutureState<void>*)
+        : _s(s) {
+        s->ref();
+    }
+
+    virtual ~AllCallback() {
+    }
+
+    virtual void Run() {
+        if (_s->left.Dec() == 0) _s->Finish();
+        delete this;
+    }
+
+  private:
+    StateRef<AllState<void> > _s;
+};
+
+template<typename T>
+struct AnyState : public RefCounted {
+    void Finish(::size_t i, FutureState<T>* f) {
+        p.SetValue(std::make_pair(i, f->value()));
+    }
+
+    Promise<std::pair< ::size_t, T> > p;
+    atomic_t done;
+};
+
+template<>
+struct AnyState<void> : public RefCounted {
+    void Finish(::size_t i, FutureState<void>*) {
+        p.SetValue(i);
+    }
+
+    Promise< ::size_t> p;
+    atomic_t done;
+};
+
+// f is alive when the callback is run, as for ThenCallback
+template<typename T>
+class AnyCallback : public Closure {
+  public:
+    AnyCallback(AnyState<T>* s, ::size_t i, FutureState<T>* f)
+        : _s(s), _i(i), _f(f) {
+        s->ref();
+    }
+
+    virtual ~AnyCallback() {
+    }
+
+    virtual void Run() {
+        if (_s->done.CompareSwap(0, 1)) _s->Finish(_i, _f);
+        delete this;
+    }
+
+  private:
+    StateRef<AnyState<T> > _s;
+    ::size_t _i;
+    FutureState<T>* _f;
+};
+
+template<typename T, typename R>
+inline Future<R> WhenAll(const std::vector<Future<T> >& v) {
+    StateRef<AllState<T> > s(new AllState<T>(v));
+    Future<R> f = s->p.GetFuture();
+
+    if (v.empty()) {
+        s->Finish();
+        return f;
+    }
+
+    for (::size_t i = 0; i < v.size(); ++i) {
+        v[i].OnReady(new AllCallback<T>(s.get(), i, v[i].state()));
+    }
+    return f;
+}
+
+template<typename T, typename R>
+inline Future<R> WhenAny(const std::vector<Future<T> >& v) {
+    CHECK(!v.empty());
+    StateRef<AnyState<T> > s(new AnyState<T>);
+    Future<R> f = s->p.GetFuture();
+
+    for (::size_t i = 0; i < v.size(); ++i) {
+        v[i].OnReady(new AnyCallback<T>(s.get(), i, v[i].state()));
+    }
+    return f;
+}
+} // namespace xx
+
+/*
+ * ready when all futures are ready, with values in the same order.
+ */
+template<typename T>
+inline Future<std::vector<T> > WhenAll(const std::vector<Future<T> >& v) {
+    return xx::WhenAll<T, std::vector<T> >(v);
+}
+
+inline Future<void> WhenAll(const std::vector<Future<void> >& v) {
+    return xx::WhenAll<void, void>(v);
+}
+
+/*
+ * ready when any future is ready, with <index, value> of the first one.
+ * v must not be empty.
+ */
+template<typename T>
+inline Future<std::pair< ::size_t, T> > WhenAny(const std::vector<Future<T> >& v) {
+    return xx::WhenAny<T, std::pair< ::size_t, T> >(v);
+}
+
+inline Future< ::size_t> WhenAny(const std::vector<Future<void> >& v) {
+    return xx::WhenAny<void, ::size_t>(v);
+}
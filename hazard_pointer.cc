@@ -0,0 +1,142 @@
+#include "hazard_pointer.h"
+
+#include <algorithm>
+
+namespace xx {
+HazardOwner::~HazardOwner() {
+    if (rec == NULL) return;
+
+    for (uint32 i = 0; i < HAZARD_SLOTS; ++i) {
+        __atomic_store_n(&rec->slots[i], static_cast<void*>(NULL), __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&rec->active, 0, __ATOMIC_RELEASE);
+
+    if (!retired.empty()) {
+        ScopedMutex m(domain->_mutex);
+        domain->_orphans.insert(domain->_orphans.end(), retired.begin(), retired.end());
+    }
+}
+} // namespace xx
+
+HazardDomain::HazardDomain()
+    : _head(NULL) {
+    _owners.reset(new ThreadLocal<xx::HazardOwner>);
+}
+
+HazardDomain::~HazardDomain() {
+    _owners.reset();    // owners hand retired nodes over to _orphans
+
+    for (::size_t i = 0; i < _orphans.size(); ++i) {
+        _orphans[i].free(_orphans[i].p);
+    }
+
+    while (_head != NULL) {
+        xx::HazardRecord* r = _head;
+        _head = r->next;
+        delete r;
+    }
+}
+
+HazardDomain* DefaultHazardDomain() {
+    static HazardDomain* kDomain = new HazardDomain;
+    return kDomain;
+}
+
+xx::HazardOwner* HazardDomain::Owner() {
+    xx::HazardOwner* o = _owners->get();
+    if (o->rec == NULL) {
+        o->domain = this;
+        o->rec = this->AcquireRecord();
+    }
+    return o;
+}
+
+// reuse a record of an exited thread, or push a new one
+xx::HazardRecord* HazardDomain::AcquireRecord() {
+    xx::HazardRecord* r = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+    for (; r != NULL; r = r->next) {
+        uint32 x = 0;
+        if (__atomic_load_n(&r->active, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&r->active, &x, 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return r;
+        }
+    }
+
+    r = new xx::HazardRecord();
+    r->active = 1;
+    r->next = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&_head, &r->next, r, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    _nrecords.Inc();
+    return r;
+}
+
+/*
+ * scan when the list is twice as long as the number of slots: at least half
+ * of the nodes are freed by a scan, so its cost is O(1) per node, and a
+ * thread never holds more than about 2 * slots retired nodes.
+ */
+void HazardDomain::Retire(void* p, void (*f)(void*)) {
+    xx::HazardOwner* o = this->Owner();
+    xx::HazardRetired x = { p, f };
+    o->retired.push_back(x);
+
+    ::size_t limit = std::max<uint32>(64, 2 * xx::HAZARD_SLOTS * _nrecords.value());
+    if (o->retired.size() >= limit) this->Scan(&o->retired);
+}
+
+void HazardDomain::Flush() {
+    this->Scan(&this->Owner()->retired);
+}
+
+void HazardDomain::Scan(std::vector<xx::HazardRetired>* v) {
+    // take orphans too, they are scanned by whoever comes first
+    std::vector<xx::HazardRetired> orphans;
+    {
+        ScopedMutex m(_mutex);
+        orphans.swap(_orphans);
+    }
+    v->insert(v->end(), orphans.begin(), orphans.end());
+
+    // pairs with the fence in HazardPointer::Protect()
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    std::vector<void*> hazards;
+    xx::HazardRecord* r = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+    for (; r != NULL; r = r->next) {
+        for (uint32 i = 0; i < xx::HAZARD_SLOTS; ++i) {
+            void* p = __atomic_load_n(&r->slots[i], __ATOMIC_ACQUIRE);
+            if (p != NULL) hazards.push_back(p);
+        }
+    }
+    std::sort(hazards.begin(), hazards.end());
+
+    ::size_t k = 0;
+    for (::size_t i = 0; i < v->size(); ++i) {
+        xx::HazardRetired& x = (*v)[i];
+        if (std::binary_search(hazards.begin(), hazards.end(), x.p)) {
+            (*v)[k++] = x;
+        } else {
+            x.free(x.p);
+        }
+    }
+    v->resize(k);
+}
+
+HazardPointer::HazardPointer(HazardDomain* d) {
+    _owner = d->Owner();
+
+    for (_index = 0; _index < xx::HAZARD_SLOTS; ++_index) {
+        if (!(_owner->used & (1u << _index))) break;
+    }
+    CHECK_LT(_index, (uint32) xx::HAZARD_SLOTS);
+
+    _owner->used |= 1u << _index;
+    _slot = &_owner->rec->slots[_index];
+}
+
+HazardPointer::~HazardPointer() {
+    this->Reset();
+    _owner->used &= ~(1u << _index);
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include "data_types.h"
+#include "scoped_ptr.h"
+#include "thread_local.h"
+#include "thread_util.h"
+
+#include <vector>
+
+/*
+ * HazardDomain: hazard pointers, for freeing nodes of lock-free structures
+ * while other threads may still read them.
+ *
+ *   A reader announces the node it is about to access in a hazard slot of its
+ *   thread. A retired node is freed only when no slot holds it. Threads keep
+ *   retired nodes in a local list and scan all slots when the list is long
+ *   enough, so the cost of a scan is shared by many nodes. Unlike epochs, a
+ *   stalled reader holds back only the few nodes in its slots.
+ *
+ *   HazardDomain* d = DefaultHazardDomain();
+ *
+ *   HazardPointer hp(d);                  // takes a slot of the thread
+ *   Node* n = hp.Protect(&xHead);         // safe to use until Reset()
+ *   ... n->next ...
+ *   hp.Reset();
+ *
+ *   // after unlinking n
+ *   d->Retire(n);                         // delete n later
+ *
+ *   Every thread has HAZARD_SLOTS slots in a domain.
+ */
+class HazardDomain;
+
+namespace xx {
+enum {
+    HAZARD_SLOTS = 8,
+};
+
+struct HazardRetired {
+    void* p;
+    void (*free)(void*);
+};
+
+// hazard slots of one thread, reused after the thread exits
+struct HazardRecord {
+    void* slots[HAZARD_SLOTS];
+    HazardRecord* next;        // list of all records, never unlinked
+    uint32 active;             // owned by a thread
+    char pad[CACHE_LINE_SIZE];
+};
+
+// record and retired nodes of the calling thread
+struct HazardOwner {
+    HazardOwner()
+        : domain(NULL), rec(NULL), used(0) {
+    }
+
+    // give back the record, hand retired nodes over to the domain
+    ~HazardOwner();
+
+    HazardDomain* domain;
+    HazardRecord* rec;
+    uint32 used;               // bit i set if slots[i] is taken
+    std::vector<HazardRetired> retired;
+};
+
+template<typename T>
+inline void DeleteNode(void* p) {
+    delete static_cast<T*>(p);
+}
+} // namespace xx
+
+class HazardDomain {
+  public:
+    HazardDomain();
+
+    // free all retired nodes, no hazard pointer may be in use
+    ~HazardDomain();
+
+    // free p by f(p) when no hazard slot holds it, p must be unlinked already
+    void Retire(void* p, void (*f)(void*));
+
+    template<typename T>
+    void Retire(T* p) {
+        this->Retire(p, &xx::DeleteNode<T>);
+    }
+
+    // scan slots and free what can be freed now
+    void Flush();
+
+  private:
+    xx::HazardRecord* _head;
+    atomic_t _nrecords;
+    scoped_ptr<ThreadLocal<xx::HazardOwner> > _owners;
+
+    Mutex _mutex;
+    std::vector<xx::HazardRetired> _orphans;   // from threads exited
+
+    xx::HazardOwner* Owner();
+    xx::HazardRecord* AcquireRecord();
+
+    // free nodes in v not held by any slot, keep the others in v
+    void Scan(std::vector<xx::HazardRetired>* v);
+
+    friend class HazardPointer;
+    friend struct xx::HazardOwner;
+
+    DISALLOW_COPY_AND_ASSIGN(HazardDomain);
+};
+
+// shared domain, never deleted
+HazardDomain* DefaultHazardDomain();
+
+/*
+ * HazardPointer: one hazard slot of the calling thread, released by the
+ * destructor. Use it in the thread that created it only.
+ */
+class HazardPointer {
+  public:
+    explicit HazardPointer(HazardDomain* d);
+
+    ~HazardPointer();
+
+    /*
+     * load *src and hold it in the slot, retry until *src has not changed
+     * after the slot is set. the returned node is safe until Reset() or the
+     * next Protect().
+     */
+    template<typename T>
+    T* Protect(T* const* src) {
+        T* p = __atomic_load_n(src, __ATOMIC_RELAXED);
+        while (true) {
+            __atomic_store_n(_slot, static_cast<void*>(p), __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            T* q = __atomic_load_n(src, __ATOMIC_ACQUIRE);
+            if (q == p) return p;
+            p = q;
+        }
+    }
+
+    // hold p, which the caller knows is not retired yet
+    void Set(void* p) {
+        __atomic_store_n(_slot, p, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+
+    void Reset() {
+        __atomic_store_n(_slot, static_cast<void*>(NULL), __ATOMIC_RELEASE);
+    }
+
+  private:
+    xx::HazardOwner* _owner;
+    void** _slot;
+    uint32 _index;
+
+    DISALLOW_COPY_AND_ASSIGN(HazardPointer);
+};
@@ -0,0 +1,455 @@
+#include "lock_profiler.h"
+#include "spin_lock.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <map>
+
+#ifndef _WIN32
+#  include <time.h>
+#  include <execinfo.h>
+#  include <stdlib.h>
+#endif
+
+namespace xx {
+bool lock_profiling = false;
+uint32 lock_stats = 0;
+
+#ifndef _WIN32
+__thread uint32 locks_held = 0;
+#else
+__declspec(thread) uint32 locks_held = 0;
+#endif
+
+struct LockStats {
+    LockStats(const void* lock, int type)
+        : lock(lock), type(type) {
+        this->Clear();
+    }
+
+    // counters are updated with relaxed atomic adds, stacks under the shard
+    void Clear() {
+        uint64* x[] = { &acquired, &contended, &wait_ns, &max_wait_ns, &hold_ns };
+        for (int i = 0; i < 5; ++i) __atomic_store_n(x[i], 0, __ATOMIC_RELAXED);
+        for (int i = 0; i < LockProfile::BUCKETS; ++i) {
+            __atomic_store_n(&wait_hist[i], 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&hold_hist[i], 0, __ATOMIC_RELAXED);
+        }
+        stacks.clear();
+    }
+
+    const void* lock;
+    int type;
+    std::string name;
+
+    uint64 acquired;
+    uint64 contended;
+    uint64 wait_ns;
+    uint64 max_wait_ns;
+    uint64 hold_ns;
+    uint64 wait_hist[LockProfile::BUCKETS];
+    uint64 hold_hist[LockProfile::BUCKETS];
+
+    std::map<std::vector<void*>, uint64> stacks;   // guarded by the shard
+};
+
+// a plain spin lock, as the locks of this library are profiled themselves
+struct ShardLock {
+    ShardLock()
+        : word(0) {
+    }
+
+    void Lock() {
+        Backoff b;
+        while (__atomic_exchange_n(&word, 1, __ATOMIC_ACQUIRE) != 0) b.Pause();
+    }
+
+    void UnLock() {
+        __atomic_store_n(&word, 0, __ATOMIC_RELEASE);
+    }
+
+    uint32 word;
+};
+
+/*
+ * stats of live locks by address, in shards. LockDestroyed() moves the stats
+ * of a lock to RetiredLocks, so a new lock at the same address starts clean.
+ */
+struct LockShard : public ShardLock {
+    std::map<const void*, LockStats*> stats;
+};
+
+// stats of destroyed locks, merged by name
+struct RetiredLocks : public ShardLock {
+    std::map<std::string, LockStats*> stats;
+};
+
+enum {
+    SHARDS = 64,
+    MAX_HELD = 32,             // lock nesting tracked for hold time
+    MAX_FRAMES = 16,
+};
+
+struct HeldLock {
+    const void* lock;
+    LockStats* stats;
+    uint64 start;
+};
+
+#ifndef _WIN32
+static __thread HeldLock xHeld[MAX_HELD];
+#else
+static __declspec(thread) HeldLock xHeld[MAX_HELD];
+#endif
+
+static uint32 xSample = 16;
+
+// never deleted, locks may be used at exit
+static LockShard* GetShards() {
+    static LockShard* kShards = new LockShard[SHARDS];
+    return kShards;
+}
+
+// never deleted, as the shards
+static RetiredLocks* GetRetired() {
+    static RetiredLocks* kRetired = new RetiredLocks;
+    return kRetired;
+}
+
+static LockShard* GetShard(const void* lock) {
+    uintptr_t x = reinterpret_cast<uintptr_t>(lock);
+    return GetShards() + ((x >> 6) ^ (x >> 12)) % SHARDS;
+}
+
+static LockStats* GetStats(const void* lock, int type) {
+    LockShard* s = GetShard(lock);
+    s->Lock();
+    LockStats*& x = s->stats[lock];
+    if (x == NULL) {
+        x = new LockStats(lock, type);
+        __atomic_add_fetch(&lock_stats, 1, __ATOMIC_RELAXED);
+    }
+    if (x->type < 0) x->type = type;
+    LockStats* r = x;
+    s->UnLock();
+    return r;
+}
+
+static inline uint32 Bucket(uint64 ns) {
+    uint32 k = 0;
+    while (ns != 0 && k < LockProfile::BUCKETS - 1) {
+        ++k;
+        ns >>= 1;
+    }
+    return k;
+}
+
+static inline void Add(uint64* x, uint64 v) {
+    __atomic_fetch_add(x, v, __ATOMIC_RELAXED);
+}
+
+static void AddStack(const void* lock, LockStats* s, void** f, int n) {
+    if (n <= 0) return;
+    std::vector<void*> v(f, f + n);
+
+    LockShard* x = GetShard(lock);
+    x->Lock();
+    ++s->stacks[v];
+    x->UnLock();
+}
+
+uint64 LockClock() {
+#ifndef _WIN32
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#else
+    static ::LARGE_INTEGER kFreq;
+    if (kFreq.QuadPart == 0) ::QueryPerformanceFrequency(&kFreq);
+    ::LARGE_INTEGER x;
+    ::QueryPerformanceCounter(&x);
+    return static_cast<uint64>(x.QuadPart / kFreq.QuadPart * 1000000000 +
+                               x.QuadPart % kFreq.QuadPart * 1000000000 / kFreq.QuadPart);
+#endif
+}
+
+void LockAcquired(const void* lock, int type, uint64 start) {
+    LockStats* s = GetStats(lock, type);
+    uint64 now = LockClock();
+    Add(&s->acquired, 1);
+
+    uint64 wait = 0;
+    if (start != 0) {
+        wait = now - start;
+        uint64 n = __atomic_add_fetch(&s->contended, 1, __ATOMIC_RELAXED);
+        Add(&s->wait_ns, wait);
+
+        uint64 m = __atomic_load_n(&s->max_wait_ns, __ATOMIC_RELAXED);
+        while (wait > m && !__atomic_compare_exchange_n(&s->max_wait_ns, &m, wait, true,
+                                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+        uint32 sample = __atomic_load_n(&xSample, __ATOMIC_RELAXED);
+        if (sample != 0 && n % sample == 1 % sample) {
+#ifndef _WIN32
+            void* f[MAX_FRAMES + 1];
+            int k = ::backtrace(f, MAX_FRAMES + 1);
+            AddStack(lock, s, f + 1, k - 1);  // without this function
+#endif
+        }
+    }
+    Add(&s->wait_hist[Bucket(wait)], 1);
+
+    if (locks_held < MAX_HELD) {
+        HeldLock& h = xHeld[locks_held++];
+        h.lock = lock;
+        h.stats = s;
+        h.start = now;
+    }
+}
+
+void LockReleased(const void* lock) {
+    for (uint32 i = locks_held; i > 0; --i) {
+        HeldLock& h = xHeld[i - 1];
+        if (h.lock != lock) continue;
+
+        uint64 hold = LockClock() - h.start;
+        Add(&h.stats->hold_ns, hold);
+        Add(&h.stats->hold_hist[Bucket(hold)], 1);
+
+        for (uint32 k = i; k < locks_held; ++k) xHeld[k - 1] = xHeld[k];
+        --locks_held;
+        return;
+    }
+}
+
+static const char* TypeName(int type) {
+    static const char* kNames[] = { "Mutex", "RwLock", "SpinLock", "AdaptiveSpinLock" };
+    return type >= 0 && type < 4 ? kNames[type] : "?";
+}
+
+static std::string LockName(const LockStats* s) {
+    if (!s->name.empty()) return s->name;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%p", s->lock);
+    return buf;
+}
+
+static void Merge(LockStats* to, const LockStats* s) {
+    Add(&to->acquired, __atomic_load_n(&s->acquired, __ATOMIC_RELAXED));
+    Add(&to->contended, __atomic_load_n(&s->contended, __ATOMIC_RELAXED));
+    Add(&to->wait_ns, __atomic_load_n(&s->wait_ns, __ATOMIC_RELAXED));
+    Add(&to->hold_ns, __atomic_load_n(&s->hold_ns, __ATOMIC_RELAXED));
+    to->max_wait_ns = std::max(to->max_wait_ns,
+                               __atomic_load_n(&s->max_wait_ns, __ATOMIC_RELAXED));
+    for (int k = 0; k < LockProfile::BUCKETS; ++k) {
+        Add(&to->wait_hist[k], __atomic_load_n(&s->wait_hist[k], __ATOMIC_RELAXED));
+        Add(&to->hold_hist[k], __atomic_load_n(&s->hold_hist[k], __ATOMIC_RELAXED));
+    }
+
+    std::map<std::vector<void*>, uint64>::const_iterator it = s->stacks.begin();
+    for (; it != s->stacks.end(); ++it) to->stacks[it->first] += it->second;
+}
+
+void LockDestroyed(const void* lock) {
+    LockStats* s = NULL;
+    LockShard* x = GetShard(lock);
+    x->Lock();
+    std::map<const void*, LockStats*>::iterator it = x->stats.find(lock);
+    if (it != x->stats.end()) {
+        s = it->second;
+        x->stats.erase(it);
+    }
+    x->UnLock();
+
+    if (s == NULL) return;
+    __atomic_sub_fetch(&lock_stats, 1, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&s->acquired, __ATOMIC_RELAXED) != 0) {
+        std::string name = s->name;
+        if (name.empty()) name = std::string("(destroyed ") + TypeName(s->type) + ")";
+
+        RetiredLocks* r = GetRetired();
+        r->Lock();
+        LockStats*& to = r->stats[name];
+        if (to == NULL) {
+            to = new LockStats(NULL, s->type);
+            to->name = name;
+        }
+        Merge(to, s);
+        r->UnLock();
+    }
+
+    delete s;
+}
+
+// add s to the profile of its name
+static void AddProfile(const LockStats* s, std::map<std::string, LockProfile>* m,
+                       std::map<std::string, std::map<std::vector<void*>, uint64> >* stacks) {
+    uint64 acquired = __atomic_load_n(&s->acquired, __ATOMIC_RELAXED);
+    if (acquired == 0) return;
+
+    std::string name = LockName(s);
+    bool added = m->find(name) == m->end();
+    LockProfile& p = (*m)[name];
+    if (added) {
+        p.name = name;
+        p.type = TypeName(s->type);
+        p.acquired = p.contended = p.wait_ns = p.max_wait_ns = p.hold_ns = 0;
+        for (int k = 0; k < LockProfile::BUCKETS; ++k) {
+            p.wait_hist[k] = p.hold_hist[k] = 0;
+        }
+    }
+
+    p.acquired += acquired;
+    p.contended += __atomic_load_n(&s->contended, __ATOMIC_RELAXED);
+    p.wait_ns += __atomic_load_n(&s->wait_ns, __ATOMIC_RELAXED);
+    p.max_wait_ns = std::max(p.max_wait_ns,
+                             __atomic_load_n(&s->max_wait_ns, __ATOMIC_RELAXED));
+    p.hold_ns += __atomic_load_n(&s->hold_ns, __ATOMIC_RELAXED);
+    for (int k = 0; k < LockProfile::BUCKETS; ++k) {
+        p.wait_hist[k] += __atomic_load_n(&s->wait_hist[k], __ATOMIC_RELAXED);
+        p.hold_hist[k] += __atomic_load_n(&s->hold_hist[k], __ATOMIC_RELAXED);
+    }
+
+    std::map<std::vector<void*>, uint64>& st = (*stacks)[name];
+    std::map<std::vector<void*>, uint64>::const_iterator j = s->stacks.begin();
+    for (; j != s->stacks.end(); ++j) st[j->first] += j->second;
+}
+
+// upper bound of the bucket holding the q-quantile
+static uint64 Quantile(const uint64* hist, double q) {
+    uint64 total = 0;
+    for (int i = 0; i < LockProfile::BUCKETS; ++i) total += hist[i];
+    if (total == 0) return 0;
+
+    uint64 n = 0;
+    for (int i = 0; i < LockProfile::BUCKETS; ++i) {
+        n += hist[i];
+        if (n >= total * q) return i == 0 ? 0 : 1ULL << i;
+    }
+    return 1ULL << (LockProfile::BUCKETS - 1);
+}
+
+static bool MoreWait(const LockProfile& a, const LockProfile& b) {
+    return a.wait_ns > b.wait_ns;
+}
+} // namespace xx
+
+void EnableLockProfiler(bool on, uint32 sample) {
+    __atomic_store_n(&xx::xSample, sample, __ATOMIC_RELAXED);
+    __atomic_store_n(&xx::lock_profiling, on, __ATOMIC_RELAXED);
+}
+
+void SetLockName(const void* lock, const std::string& name) {
+    xx::LockStats* s = xx::GetStats(lock, -1);
+    xx::LockShard* x = xx::GetShard(lock);
+    x->Lock();
+    s->name = name;
+    x->UnLock();
+}
+
+void GetLockProfiles(std::vector<LockProfile>* v) {
+    std::map<std::string, LockProfile> m;
+    std::map<std::string, std::map<std::vector<void*>, uint64> > stacks;
+
+    for (int i = 0; i < xx::SHARDS; ++i) {
+        xx::LockShard* x = xx::GetShards() + i;
+        x->Lock();
+
+        std::map<const void*, xx::LockStats*>::iterator it = x->stats.begin();
+        for (; it != x->stats.end(); ++it) xx::AddProfile(it->second, &m, &stacks);
+        x->UnLock();
+    }
+
+    xx::RetiredLocks* r = xx::GetRetired();
+    r->Lock();
+    std::map<std::string, xx::LockStats*>::iterator x = r->stats.begin();
+    for (; x != r->stats.end(); ++x) xx::AddProfile(x->second, &m, &stacks);
+    r->UnLock();
+
+    v->clear();
+    std::map<std::string, LockProfile>::iterator it = m.begin();
+    for (; it != m.end(); ++it) {
+        v->push_back(it->second);
+        LockProfile& p = v->back();
+
+        std::map<std::vector<void*>, uint64>& st = stacks[it->first];
+        std::map<std::vector<void*>, uint64>::iterator j = st.begin();
+        for (; j != st.end(); ++j) {
+            std::vector<std::string> frames;
+#ifndef _WIN32
+            const std::vector<void*>& f = j->first;
+            char** sym = ::backtrace_symbols(&f[0], static_cast<int>(f.size()));
+            if (sym != NULL) {
+                frames.assign(sym, sym + f.size());
+                ::free(sym);
+            }
+#endif
+            p.stacks.push_back(std::make_pair(j->second, frames));
+        }
+        std::sort(p.stacks.rbegin(), p.stacks.rend());
+    }
+
+    std::sort(v->begin(), v->end(), xx::MoreWait);
+}
+
+std::string DumpLockProfiles(uint32 n) {
+    std::vector<LockProfile> v;
+    GetLockProfiles(&v);
+    if (v.size() > n) v.resize(n);
+
+    std::string s;
+    char buf[512];
+    for (::size_t i = 0; i < v.size(); ++i) {
+        const LockProfile& p = v[i];
+        snprintf(buf, sizeof(buf),
+                 "%s (%s): acquired %llu, contended %llu (%.2f%%), "
+                 "wait %lluus, max wait %lluus, hold %lluus\n",
+                 p.name.c_str(), p.type.c_str(),
+                 (unsigned long long) p.acquired, (unsigned long long) p.contended,
+                 p.acquired > 0 ? 100.0 * p.contended / p.acquired : 0.0,
+                 (unsigned long long) p.wait_ns / 1000,
+                 (unsigned long long) p.max_wait_ns / 1000,
+                 (unsigned long long) p.hold_ns / 1000);
+        s += buf;
+
+        snprintf(buf, sizeof(buf),
+                 "  wait ns  p50 <= %llu, p90 <= %llu, p99 <= %llu\n"
+                 "  hold ns  p50 <= %llu, p90 <= %llu, p99 <= %llu\n",
+                 (unsigned long long) xx::Quantile(p.wait_hist, 0.5),
+                 (unsigned long long) xx::Quantile(p.wait_hist, 0.9),
+                 (unsigned long long) xx::Quantile(p.wait_hist, 0.99),
+                 (unsigned long long) xx::Quantile(p.hold_hist, 0.5),
+                 (unsigned long long) xx::Quantile(p.hold_hist, 0.9),
+                 (unsigned long long) xx::Quantile(p.hold_hist, 0.99));
+        s += buf;
+
+        for (::size_t k = 0; k < p.stacks.size() && k < 5; ++k) {
+            snprintf(buf, sizeof(buf), "  stack x%llu\n",
+                     (unsigned long long) p.stacks[k].first);
+            s += buf;
+            for (::size_t f = 0; f < p.stacks[k].second.size(); ++f) {
+                s += "    " + p.stacks[k].second[f] + "\n";
+            }
+        }
+    }
+    return s;
+}
+
+// stats are cleared in place, held locks may still point to them
+void ResetLockProfiles() {
+    for (int i = 0; i < xx::SHARDS; ++i) {
+        xx::LockShard* x = xx::GetShards() + i;
+        x->Lock();
+        std::map<const void*, xx::LockStats*>::iterator it = x->stats.begin();
+        for (; it != x->stats.end(); ++it) it->second->Clear();
+        x->UnLock();
+    }
+
+    xx::RetiredLocks* r = xx::GetRetired();
+    r->Lock();
+    std::map<std::string, xx::LockStats*>::iterator it = r->stats.begin();
+    for (; it != r->stats.end(); ++it) delete it->second;
+    r->stats.clear();
+    r->UnLock();
+}
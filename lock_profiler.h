@@ -0,0 +1,148 @@
+#pragma once
+
+#include "data_types.h"
+
+#include <string>
+#include <vector>
+
+/*
+ * Lock contention profiler for Mutex, RwLock, SpinLock and AdaptiveSpinLock.
+ *
+ *   Build with -DLOCK_PROFILER to compile the hooks into the locks, then turn
+ *   profiling on at runtime. Without LOCK_PROFILER the locks are unchanged;
+ *   with it but turned off, a lock operation costs one more branch.
+ *
+ *   For every lock instance (by address), or every name given by
+ *   SetLockName(), it records acquisitions, contended acquisitions (the
+ *   first try failed), histograms of wait and hold time, and call stacks of
+ *   sampled contended acquisitions. Stats of a destroyed lock are merged into
+ *   its name, or into "(destroyed <type>)" if it has none.
+ *
+ *   EnableLockProfiler(true);          // stack of 1 in 16 contended acquisitions
+ *   SetLockName(&_mutex, "cache");     // locks with the same name are merged
+ *   ...
+ *   LOG << DumpLockProfiles();         // top locks by total wait time
+ *   ResetLockProfiles();
+ */
+
+struct LockProfile {
+    enum { BUCKETS = 32 };
+
+    std::string name;          // name, or address of the lock
+    std::string type;          // Mutex, RwLock, SpinLock...
+    uint64 acquired;
+    uint64 contended;
+    uint64 wait_ns;            // total wait of contended acquisitions
+    uint64 max_wait_ns;
+    uint64 hold_ns;            // total hold time
+
+    // log2 histograms in ns: [0] for 0, [k] for [2^(k-1), 2^k)
+    uint64 wait_hist[BUCKETS];
+    uint64 hold_hist[BUCKETS];
+
+    // sampled call stacks of contended acquisitions, by count
+    std::vector<std::pair<uint64, std::vector<std::string> > > stacks;
+};
+
+/*
+ * turn profiling on or off, it is off by default.
+ * sample: capture the stack of one in every sample contended acquisitions,
+ *         0 for no stacks.
+ */
+void EnableLockProfiler(bool on, uint32 sample = 16);
+
+// name a lock in profiles, must be called before it is used
+void SetLockName(const void* lock, const std::string& name);
+
+// profiles of all locks used while profiling, by total wait time
+void GetLockProfiles(std::vector<LockProfile>* v);
+
+// text report of the top n locks
+std::string DumpLockProfiles(uint32 n = 20);
+
+void ResetLockProfiles();
+
+namespace xx {
+enum {
+    LOCK_MUTEX = 0,
+    LOCK_RWLOCK = 1,
+    LOCK_SPIN = 2,
+    LOCK_ADAPTIVE_SPIN = 3,
+};
+
+extern bool lock_profiling;
+extern uint32 lock_stats;               // number of live locks with stats
+
+#ifndef _WIN32
+extern __thread uint32 locks_held;      // locks recorded for the calling thread
+#else
+extern __declspec(thread) uint32 locks_held;
+#endif
+
+inline bool LockProfiling() {
+    return __atomic_load_n(&lock_profiling, __ATOMIC_RELAXED);
+}
+
+// monotonic clock in ns
+uint64 LockClock();
+
+// start: when the thread began to wait, 0 if not contended
+void LockAcquired(const void* lock, int type, uint64 start);
+
+void LockReleased(const void* lock);
+
+// merge the stats of the lock into its name, and forget its address
+void LockDestroyed(const void* lock);
+
+inline bool LockTried(const void* lock, int type, bool ok) {
+    if (ok && LockProfiling()) LockAcquired(lock, type, 0);
+    return ok;
+}
+} // namespace xx
+
+/*
+ * hooks for lock classes:
+ *
+ *   void Lock()    { LOCK_PROFILE_LOCK(type, fast try, blocking lock); }
+ *   bool TryLock() { return LOCK_PROFILE_TRY(type, ok); }
+ *   void UnLock()  { LOCK_PROFILE_UNLOCK(); ... }
+ *   ~Lock()        { LOCK_PROFILE_DESTROY(); }
+ *
+ * the blocking lock is complete by itself: without LOCK_PROFILER it is all
+ * that Lock() does, the try is only made to tell contended acquisitions.
+ */
+#ifdef LOCK_PROFILER
+#define LOCK_PROFILE_LOCK(type, try_lock, lock) \
+    do { \
+        if (!xx::LockProfiling()) { \
+            if (!(try_lock)) lock; \
+            break; \
+        } \
+        uint64 _start = 0; \
+        if (!(try_lock)) { \
+            _start = xx::LockClock(); \
+            lock; \
+        } \
+        xx::LockAcquired(this, type, _start); \
+    } while (0)
+
+#define LOCK_PROFILE_TRY(type, ok)  xx::LockTried(this, type, ok)
+
+#define LOCK_PROFILE_UNLOCK() \
+    do { \
+        if (xx::locks_held != 0) xx::LockReleased(this); \
+    } while (0)
+
+#define LOCK_PROFILE_DESTROY() \
+    do { \
+        if (__atomic_load_n(&xx::lock_stats, __ATOMIC_RELAXED) != 0) { \
+            xx::LockDestroyed(this); \
+        } \
+    } while (0)
+
+#else
+#define LOCK_PROFILE_LOCK(type, try_lock, lock)  lock
+#define LOCK_PROFILE_TRY(type, ok)  (ok)
+#define LOCK_PROFILE_UNLOCK()
+#define LOCK_PROFILE_DESTROY()
+#endif
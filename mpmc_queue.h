@@ -0,0 +1,333 @@
+#pragma once
+
+#include "data_types.h"
+#include "atomic.h"
+#include "thread_util.h"
+
+/*
+ * MpmcQueue: bounded lock-free multi-producer/multi-consumer queue.
+ *
+ *   A ring of cells, each with a sequence number telling whether it is free
+ *   for the producer of this round or filled for the consumer (D. Vyukov).
+ *   A push or pop is one CAS on the head or tail index, and the two indices
+ *   sit on separate cache lines.
+ *
+ *   T must be default constructible and copyable, Closure* for example.
+ *
+ *   MpmcQueue<Closure*> q(1024);      // capacity is rounded up to power of 2
+ *   q.TryPush(c);                     // false if full
+ *   q.TryPop(&c);                     // false if empty
+ *   q.TryPushBatch(v, n);             // return number of elements pushed
+ *   q.TryPopBatch(v, n);              // return number of elements popped
+ */
+template<typename T>
+class MpmcQueue {
+  public:
+    explicit MpmcQueue(uint32 capacity) {
+        uint32 n = 2;
+        while (n < capacity) n <<= 1;
+
+        _mask = n - 1;
+        _cells = new Cell[n];
+        for (uint32 i = 0; i < n; ++i) {
+            __atomic_store_n(&_cells[i].seq, i, __ATOMIC_RELAXED);
+        }
+
+        _head = 0;
+        _tail = 0;
+    }
+
+    ~MpmcQueue() {
+        delete[] _cells;
+    }
+
+    uint32 capacity() const {
+        return _mask + 1;
+    }
+
+    // approximate when other threads are working on the queue
+    uint32 size() const {
+        uint64 t = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+        uint64 h = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+        return h > t ? static_cast<uint32>(h - t) : 0;
+    }
+
+    bool TryPush(const T& v) {
+        return this->TryPushBatch(&v, 1) == 1;
+    }
+
+    bool TryPop(T* v) {
+        return this->TryPopBatch(v, 1) == 1;
+    }
+
+    /*
+     * claim up to n free cells in a row with one CAS, then fill them.
+     * return number of elements pushed, 0 if the queue is full.
+     */
+    uint32 TryPushBatch(const T* v, uint32 n) {
+        if (n == 0) return 0;
+        uint64 pos = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+
+        while (true) {
+            uint32 k = this->Count(pos, n, 0);
+            if (k == 0) {
+                Cell& c = _cells[pos & _mask];
+                uint64 seq = __atomic_load_n(&c.seq, __ATOMIC_ACQUIRE);
+                if (seq < pos) return 0;  // full, the cell is not consumed yet
+
+                pos = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+                continue;
+            }
+
+            if (__atomic_compare_exchange_n(&_head, &pos, pos + k, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                for (uint32 i = 0; i < k; ++i) {
+                    Cell& c = _cells[(pos + i) & _mask];
+                    c.v = v[i];
+                    __atomic_store_n(&c.seq, pos + i + 1, __ATOMIC_RELEASE);
+                }
+                return k;
+            }
+        }
+    }
+
+    /*
+     * claim up to n filled cells in a row with one CAS, then empty them.
+     * return number of elements popped, 0 if the queue is empty.
+     */
+    uint32 TryPopBatch(T* v, uint32 n) {
+        if (n == 0) return 0;
+        uint64 pos = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+
+        while (true) {
+            uint32 k = this->Count(pos, n, 1);
+            if (k == 0) {
+                Cell& c = _cells[pos & _mask];
+                uint64 seq = __atomic_load_n(&c.seq, __ATOMIC_ACQUIRE);
+                if (seq < pos + 1) return 0;  // empty, the cell is not filled yet
+
+                pos = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+                continue;
+            }
+
+            if (__atomic_compare_exchange_n(&_tail, &pos, pos + k, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                for (uint32 i = 0; i < k; ++i) {
+                    Cell& c = _cells[(pos + i) & _mask];
+                    v[i] = c.v;
+                    c.v = T();
+                    __atomic_store_n(&c.seq, pos + i + _mask + 1, __ATOMIC_RELEASE);
+                }
+                return k;
+            }
+        }
+    }
+
+  private:
+    struct Cell {
+        uint64 seq;
+        T v;
+    };
+
+    Cell* _cells;
+    uint32 _mask;
+
+    char _pad0[CACHE_LINE_SIZE];
+    uint64 _head;                    // next cell to push
+    char _pad1[CACHE_LINE_SIZE - sizeof(uint64)];
+    uint64 _tail;                    // next cell to pop
+    char _pad2[CACHE_LINE_SIZE - sizeof(uint64)];
+
+    // number of cells in a row from pos, ready for push (d = 0) or pop (d = 1)
+    uint32 Count(uint64 pos, uint32 n, uint32 d) const {
+        uint32 k = 0;
+        while (k < n && k <= _mask) {
+            const Cell& c = _cells[(pos + k) & _mask];
+            if (__atomic_load_n(&c.seq, __ATOMIC_ACQUIRE) != pos + k + d) break;
+            ++k;
+        }
+        return k;
+    }
+
+    DISALLOW_COPY_AND_ASSIGN(MpmcQueue);
+};
+
+/*
+ * BlockingMpmcQueue: MpmcQueue with blocking Push() and Pop().
+ *
+ *   Threads sleep on a SyncEvent only when the queue is full or empty, and
+ *   the other side signals the event only when someone is sleeping.
+ *
+ *   Close() tells consumers that nothing more will be pushed, so they can
+ *   drain the queue and quit:
+ *
+ *   while (q.Pop(&c)) c->Run();      // in consumer threads
+ *   q.Close();                       // after the last Push()
+ */
+template<typename T>
+class BlockingMpmcQueue {
+  public:
+    explicit BlockingMpmcQueue(uint32 capacity)
+        : _q(capacity), _not_full(false, false), _not_empty(false, false) {
+    }
+
+    ~BlockingMpmcQueue() {
+    }
+
+    MpmcQueue<T>& queue() {
+        return _q;
+    }
+
+    bool TryPush(const T& v) {
+        if (!_q.TryPush(v)) return false;
+        this->Pushed();
+        return true;
+    }
+
+    bool TryPop(T* v) {
+        if (!_q.TryPop(v)) return false;
+        this->Popped();
+        return true;
+    }
+
+    uint32 TryPushBatch(const T* v, uint32 n) {
+        uint32 k = _q.TryPushBatch(v, n);
+        if (k > 0) this->Pushed();
+        return k;
+    }
+
+    uint32 TryPopBatch(T* v, uint32 n) {
+        uint32 k = _q.TryPopBatch(v, n);
+        if (k > 0) this->Popped();
+        return k;
+    }
+
+    // block while the queue is full
+    void Push(const T& v) {
+        while (!_q.TryPush(v)) {
+            _push_waiters.Inc();
+            if (_q.TryPush(v)) {
+                _push_waiters.Dec();
+                break;
+            }
+            _not_full.Wait();
+            _push_waiters.Dec();
+        }
+        this->Pushed();
+    }
+
+    /*
+     * block while the queue is empty.
+     * return false if the queue is closed and empty.
+     */
+    bool Pop(T* v) {
+        while (!_q.TryPop(v)) {
+            _pop_waiters.Inc();
+            if (_q.TryPop(v)) {
+                _pop_waiters.Dec();
+                break;
+            }
+
+            if (_closed.value() != 0) {
+                _pop_waiters.Dec();
+                _not_empty.Notify();  // pass the wakeup on to the next waiter
+                return false;
+            }
+
+            _not_empty.Wait();
+            _pop_waiters.Dec();
+        }
+        this->Popped();
+        return true;
+    }
+
+    // return false if timeout, or the queue is closed and empty
+    bool TimedPop(T* v, uint32 ms) {
+        if (!_q.TryPop(v)) {
+            _pop_waiters.Inc();
+            bool ok = _q.TryPop(v) ||
+                (_closed.value() == 0 && _not_empty.TimedWait(ms) && _q.TryPop(v));
+            _pop_waiters.Dec();
+            if (!ok) {
+                if (_closed.value() != 0) _not_empty.Notify();
+                return false;
+            }
+        }
+        this->Popped();
+        return true;
+    }
+
+    // push all, block while the queue is full
+    void PushBatch(const T* v, uint32 n) {
+        while (n > 0) {
+            uint32 k = _q.TryPushBatch(v, n);
+            if (k == 0) {
+                this->Push(*v);
+                k = 1;
+            } else {
+                this->Pushed();
+            }
+            v += k;
+            n -= k;
+        }
+    }
+
+    /*
+     * pop at least one, block while the queue is empty.
+     * return 0 if the queue is closed and empty.
+     */
+    uint32 PopBatch(T* v, uint32 n) {
+        if (n == 0) return 0;
+        uint32 k = _q.TryPopBatch(v, n);
+        if (k > 0) {
+            this->Popped();
+            return k;
+        }
+
+        if (!this->Pop(v)) return 0;
+        return 1 + (n > 1 ? this->TryPopBatch(v + 1, n - 1) : 0);
+    }
+
+    /*
+     * no more elements will be pushed: wake up all waiting consumers, Pop()
+     * returns false from now on once the queue is empty.
+     */
+    void Close() {
+        _closed.CompareSwap(0, 1);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (_pop_waiters.value() != 0) _not_empty.Notify();
+    }
+
+  private:
+    MpmcQueue<T> _q;
+    SyncEvent _not_full;
+    SyncEvent _not_empty;
+    atomic_t _push_waiters;
+    atomic_t _pop_waiters;
+    atomic_t _closed;
+
+    /*
+     * the fence pairs with the atomic Inc() of a waiter: either the waiter
+     * sees the new element, or we see the waiter.
+     *
+     * Notify() of an auto-reset event may be merged with one not consumed
+     * yet, so a thread that has waited may be the only one woken up for
+     * several elements or free cells. The wakeup is passed on by whoever
+     * pushes or pops next while there are still waiters and work for them.
+     */
+    void Pushed() {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (_pop_waiters.value() != 0) _not_empty.Notify();
+        if (_push_waiters.value() != 0 && _q.size() < _q.capacity()) {
+            _not_full.Notify();
+        }
+    }
+
+    void Popped() {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (_push_waiters.value() != 0) _not_full.Notify();
+        if (_pop_waiters.value() != 0 && _q.size() > 0) _not_empty.Notify();
+    }
+
+    DISALLOW_COPY_AND_ASSIGN(BlockingMpmcQueue);
+};
@@ -0,0 +1,37 @@
+#include "parallel.h"
+
+static ThreadPool* NewParallelPool() {
+    ThreadPool* pool = new ThreadPool;
+    CHECK(pool->Start());
+    return pool;
+}
+
+// never deleted, closures may still run on it at exit
+ThreadPool* ParallelPool() {
+    static ThreadPool* kPool = NewParallelPool();
+    return kPool;
+}
+
+namespace xx {
+void ParallelJob::Run(ThreadPool* pool) {
+    _helpers = std::min(pool->size(), _nchunks) - 1;
+
+    for (uint32 i = 0; i < _helpers; ++i) {
+        this->ref();
+        pool->Post(NewCallback(this, &ParallelJob::Help));
+    }
+
+    this->Work();
+
+    // help the pool, helpers of this job may still be queued
+    while (_done.value() != _helpers) {
+        if (!pool->RunOne()) _ev.TimedWait(1);
+    }
+}
+
+void ParallelJob::Help() {
+    this->Work();
+    if (_done.Inc() == _helpers) _ev.Notify();
+    this->unref();
+}
+} // namespace xx
@@ -0,0 +1,259 @@
+#pragma once
+
+#include "data_types.h"
+#include "atomic.h"
+#include "ref_counting.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+/*
+ * Parallel algorithms on a ThreadPool.
+ *
+ *   The range is cut into chunks of grain elements (grain == 0: chosen by the
+ *   size of the range and the pool). The calling thread and up to size() - 1
+ *   workers take chunks one by one, so faster threads take more. While
+ *   waiting for the others, the calling thread runs pending closures of the
+ *   pool, so these algorithms can be nested in closures running on the pool.
+ *
+ *   ParallelFor(0, v.size(), 0, [&](size_t i) { v[i] *= 2; });
+ *
+ *   int64 sum = ParallelReduce(0, v.size(), 0, (int64) 0,
+ *       [&](size_t i) { return (int64) v[i]; },
+ *       [](int64 a, int64 b) { return a + b; });
+ *
+ *   ParallelTransform(a.begin(), a.end(), b.begin(), [](int x) { return x * x; });
+ *   ParallelSort(v.begin(), v.end());
+ */
+
+// shared pool for the algorithms, one worker per cpu, started on first use
+ThreadPool* ParallelPool();
+
+namespace xx {
+/*
+ * run RunChunk(0 ... n - 1) on the pool and the calling thread.
+ * ref counted, as helpers may still hold it after Run() returns.
+ */
+class ParallelJob : public RefCounted {
+  public:
+    explicit ParallelJob(uint32 nchunks)
+        : _nchunks(nchunks), _helpers(0), _ev(false, false) {
+    }
+
+    // return when all chunks are done
+    void Run(ThreadPool* pool);
+
+  protected:
+    virtual ~ParallelJob() {
+    }
+
+    virtual void RunChunk(uint32 i) = 0;
+
+  private:
+    const uint32 _nchunks;
+    uint32 _helpers;
+    atomic_t _next;
+    atomic_t _done;
+    SyncEvent _ev;
+
+    // take chunks until none left
+    void Work() {
+        uint32 i;
+        while ((i = _next.Inc() - 1) < _nchunks) {
+            this->RunChunk(i);
+        }
+    }
+
+    void Help();
+};
+
+template<typename F>
+class ChunkJob : public ParallelJob {
+  public:
+    ChunkJob(uint32 nchunks, F& f)
+        : ParallelJob(nchunks), _f(f) {
+    }
+
+  protected:
+    virtual ~ChunkJob() {
+    }
+
+    virtual void RunChunk(uint32 i) {
+        _f(i);
+    }
+
+  private:
+    F& _f;    // owned by the caller of Run()
+};
+
+// fn(i) for i in [0, nchunks)
+template<typename F>
+inline void RunChunks(ThreadPool* pool, uint32 nchunks, F fn) {
+    if (nchunks == 0) return;
+
+    if (nchunks == 1 || pool == NULL || pool->size() <= 1) {
+        for (uint32 i = 0; i < nchunks; ++i) fn(i);
+        return;
+    }
+
+    ParallelJob* job = new ChunkJob<F>(nchunks, fn);
+    job->Run(pool);
+    job->unref();
+}
+
+// grain: 0 for about 8 chunks per thread
+inline ::size_t GrainSize(::size_t n, ::size_t grain, ThreadPool* pool) {
+    if (grain > 0) return grain;
+    ::size_t threads = pool != NULL ? pool->size() : 1;
+    grain = n / (threads * 8);
+    return grain > 0 ? grain : 1;
+}
+
+template<typename F>
+struct ForChunk {
+    ::size_t begin, end, grain;
+    F* fn;
+
+    void operator()(uint32 c) {
+        ::size_t lo = begin + c * grain;
+        ::size_t hi = std::min(end, lo + grain);
+        for (::size_t i = lo; i < hi; ++i) (*fn)(i);
+    }
+};
+
+template<typename T, typename M, typename R>
+struct ReduceChunk {
+    ::size_t begin, end, grain;
+    const T* identity;
+    M* map;
+    R* reduce;
+    std::vector<T>* results;
+
+    void operator()(uint32 c) {
+        ::size_t lo = begin + c * grain;
+        ::size_t hi = std::min(end, lo + grain);
+        T v = *identity;
+        for (::size_t i = lo; i < hi; ++i) v = (*reduce)(v, (*map)(i));
+        (*results)[c] = v;
+    }
+};
+
+template<typename I, typename C>
+struct SortChunk {
+    I begin;
+    ::size_t n, chunk;
+    C* comp;
+
+    void operator()(uint32 c) {
+        ::size_t lo = std::min(n, c * chunk);
+        ::size_t hi = std::min(n, lo + chunk);
+        std::sort(begin + lo, begin + hi, *comp);
+    }
+};
+
+// merge sorted runs [2k * w, (2k + 1) * w) and [(2k + 1) * w, (2k + 2) * w)
+template<typename I, typename C>
+struct MergeChunk {
+    I begin;
+    ::size_t n, width;
+    C* comp;
+
+    void operator()(uint32 k) {
+        ::size_t lo = 2 * k * width;
+        ::size_t mid = std::min(n, lo + width);
+        ::size_t hi = std::min(n, mid + width);
+        std::inplace_merge(begin + lo, begin + mid, begin + hi, *comp);
+    }
+};
+} // namespace xx
+
+/*
+ * fn(i) for i in [begin, end)
+ */
+template<typename F>
+inline void ParallelFor(::size_t begin, ::size_t end, ::size_t grain, F fn,
+                        ThreadPool* pool = ParallelPool()) {
+    if (begin >= end) return;
+
+    ::size_t n = end - begin;
+    grain = xx::GrainSize(n, grain, pool);
+
+    xx::ForChunk<F> chunk = { begin, end, grain, &fn };
+    xx::RunChunks(pool, static_cast<uint32>((n + grain - 1) / grain), chunk);
+}
+
+/*
+ * reduce(... reduce(reduce(identity, map(begin)), map(begin + 1)) ...)
+ *   reduce must be associative, identity must be its identity element.
+ *   chunk results are combined in order, so the result is deterministic.
+ */
+template<typename T, typename M, typename R>
+inline T ParallelReduce(::size_t begin, ::size_t end, ::size_t grain,
+                        const T& identity, M map, R reduce,
+                        ThreadPool* pool = ParallelPool()) {
+    if (begin >= end) return identity;
+
+    ::size_t n = end - begin;
+    grain = xx::GrainSize(n, grain, pool);
+    ::size_t nchunks = (n + grain - 1) / grain;
+
+    std::vector<T> results(nchunks, identity);
+    xx::ReduceChunk<T, M, R> chunk = {
+        begin, end, grain, &identity, &map, &reduce, &results
+    };
+    xx::RunChunks(pool, static_cast<uint32>(nchunks), chunk);
+
+    T v = identity;
+    for (::size_t i = 0; i < nchunks; ++i) v = reduce(v, results[i]);
+    return v;
+}
+
+/*
+ * *(out + i) = fn(*(first + i)) for every element in [first, last)
+ *   random access iterators only.
+ */
+template<typename I, typename O, typename F>
+inline void ParallelTransform(I first, I last, O out, F fn,
+                              ThreadPool* pool = ParallelPool()) {
+    ParallelFor(0, static_cast< ::size_t>(last - first), 0,
+                [&](::size_t i) { *(out + i) = fn(*(first + i)); }, pool);
+}
+
+/*
+ * parallel merge sort: sort one run per chunk, then merge runs in pairs,
+ * halving the number of runs in every round. not stable.
+ */
+template<typename I, typename C>
+inline void ParallelSort(I first, I last, C comp,
+                         ThreadPool* pool = ParallelPool()) {
+    ::size_t n = static_cast< ::size_t>(last - first);
+    ::size_t threads = pool != NULL ? pool->size() : 1;
+    if (n < 4096 || threads <= 1) {
+        std::sort(first, last, comp);
+        return;
+    }
+
+    // about two runs for each thread. rounding chunk up may leave fewer
+    // runs than planned, none of them empty.
+    ::size_t runs = 1;
+    while (runs < threads * 2) runs <<= 1;
+    ::size_t chunk = (n + runs - 1) / runs;
+    runs = (n + chunk - 1) / chunk;
+
+    xx::SortChunk<I, C> sort = { first, n, chunk, &comp };
+    xx::RunChunks(pool, static_cast<uint32>(runs), sort);
+
+    for (::size_t width = chunk; width < n; width *= 2) {
+        ::size_t pairs = (n + 2 * width - 1) / (2 * width);
+        xx::MergeChunk<I, C> merge = { first, n, width, &comp };
+        xx::RunChunks(pool, static_cast<uint32>(pairs), merge);
+    }
+}
+
+template<typename I>
+inline void ParallelSort(I first, I last, ThreadPool* pool = ParallelPool()) {
+    typedef typename std::iterator_traits<I>::value_type T;
+    ParallelSort(first, last, std::less<T>(), pool);
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "data_types.h"
+#include "sharded_counter.h"
+#include "spin_lock.h"
+#include "thread_util.h"
+
+/*
+ * PerCpuRwLock: reader-writer lock for data read by many threads and written
+ * rarely.
+ *
+ *   A reader only increments and decrements a counter on a cache line of its
+ *   own (one per cpu, a thread always uses the same one), and reads the writer
+ *   flag, which stays in its cache while there is no writer. So readers on
+ *   different cpus never touch the same line, and reads scale with cores.
+ *
+ *   A writer sets the flag, then waits for the counter of every cpu to drain.
+ *   New readers step back and wait for the writer, so writers are not starved.
+ *   Writes cost a scan over all cpus, use RwLock if they are frequent.
+ *
+ *   Read locks are not reentrant: a thread holding a read lock must not take
+ *   it again, a writer may be waiting in between.
+ *
+ *   PerCpuRwLock l;
+ *   {
+ *       ScopedPerCpuReadLock r(l);
+ *       ...
+ *   }
+ *   {
+ *       ScopedPerCpuWriteLock w(l);
+ *       ...
+ *   }
+ */
+class PerCpuRwLock {
+  public:
+    // shards: number of reader counters, 0 for one per cpu
+    explicit PerCpuRwLock(uint32 shards = 0)
+        : _readers(shards, 0), _writer(0) {
+    }
+
+    ~PerCpuRwLock() {
+    }
+
+    void ReadLock() {
+        while (!this->TryReadLock()) {
+            ScopedMutex m(_mutex);  // wait for the writer
+        }
+    }
+
+    void ReadUnLock() {
+        __atomic_sub_fetch(_readers.local(), 1, __ATOMIC_RELEASE);
+    }
+
+    /*
+     * the fence pairs with the one in WriteLock(): either the writer sees our
+     * counter, or we see the writer.
+     */
+    bool TryReadLock() {
+        uint32* n = _readers.local();
+        __atomic_add_fetch(n, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&_writer, __ATOMIC_ACQUIRE) == 0) return true;
+
+        __atomic_sub_fetch(n, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    void WriteLock() {
+        _mutex.Lock();
+        __atomic_store_n(&_writer, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        for (uint32 i = 0; i < _readers.size(); ++i) {
+            xx::Backoff b;
+            while (__atomic_load_n(_readers.at(i), __ATOMIC_ACQUIRE) != 0) b.Pause();
+        }
+    }
+
+    void WriteUnLock() {
+        __atomic_store_n(&_writer, 0, __ATOMIC_RELEASE);
+        _mutex.UnLock();
+    }
+
+    bool TryWriteLock() {
+        if (!_mutex.TryLock()) return false;
+        __atomic_store_n(&_writer, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        for (uint32 i = 0; i < _readers.size(); ++i) {
+            if (__atomic_load_n(_readers.at(i), __ATOMIC_ACQUIRE) != 0) {
+                this->WriteUnLock();
+                return false;
+            }
+        }
+        return true;
+    }
+
+  private:
+    xx::Shards<uint32> _readers;
+    uint32 _writer;            // 1 while a writer holds or waits for the lock
+    Mutex _mutex;              // held by the writer
+
+    DISALLOW_COPY_AND_ASSIGN(PerCpuRwLock);
+};
+
+class ScopedPerCpuReadLock {
+  public:
+    explicit ScopedPerCpuReadLock(PerCpuRwLock& lock)
+        : _lock(lock) {
+        _lock.ReadLock();
+    }
+
+    ~ScopedPerCpuReadLock() {
+        _lock.ReadUnLock();
+    }
+
+  private:
+    PerCpuRwLock& _lock;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedPerCpuReadLock);
+};
+
+class ScopedPerCpuWriteLock {
+  public:
+    explicit ScopedPerCpuWriteLock(PerCpuRwLock& lock)
+        : _lock(lock) {
+        _lock.WriteLock();
+    }
+
+    ~ScopedPerCpuWriteLock() {
+        _lock.WriteUnLock();
+    }
+
+  private:
+    PerCpuRwLock& _lock;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedPerCpuWriteLock);
+};
@@ -0,0 +1,282 @@
+#pragma once
+
+#include "data_types.h"
+#include "atomic.h"
+#include "mpmc_queue.h"
+#include "scoped_ptr.h"
+#include "thread_util.h"
+
+#include <string>
+#include <vector>
+
+/*
+ * Pipeline<T>: items of type T flow through a chain of stages.
+ *
+ *   Every stage has a bounded input queue and its own threads. A thread pops
+ *   up to batch_size items, runs the stage function on the batch, and pushes
+ *   what is left in the batch to the next stage. The function may modify,
+ *   erase or append items. Items out of the last stage are discarded.
+ *
+ *   When the input queue of a stage is full, the upstream blocks, or with
+ *   shed == true the new items are dropped and passed to the drop function
+ *   of the pipeline (if any), so a slow stage never makes memory balloon.
+ *
+ *   Pipeline<Msg*> p(&DeleteMsg);           // free dropped items, optional
+ *
+ *   StageOptions opt;
+ *   opt.parallelism = 4;
+ *   opt.batch_size = 32;
+ *   p.AddStage("parse", [](std::vector<Msg*>* v) { ... }, opt);
+ *   p.AddStage("store", &Store);            // void Store(std::vector<Msg*>*)
+ *
+ *   p.Start();
+ *   p.Push(msg);                            // false if dropped
+ *   p.Stop();                               // drain all stages, then join
+ *
+ *   std::vector<StageStats> v;
+ *   p.Stats(&v);   // the stage with a full queue ahead of an empty one is
+ *                  // the bottleneck. sample twice for throughput.
+ */
+struct StageOptions {
+    StageOptions()
+        : parallelism(1), batch_size(1), queue_size(1024), shed(false) {
+    }
+
+    uint32 parallelism;        // number of threads
+    uint32 batch_size;         // max items per call of the stage function
+    uint32 queue_size;         // capacity of the input queue
+    bool shed;                 // drop items when the input queue is full,
+                               // instead of blocking the upstream
+};
+
+struct StageStats {
+    std::string name;
+    uint64 in;                 // items accepted by the input queue
+    uint64 out;                // items passed on after the stage function
+    uint64 dropped;            // items shed since the input queue was full
+    uint64 batches;            // calls of the stage function
+    uint32 queued;             // items in the input queue now
+    uint32 capacity;           // capacity of the input queue
+    uint32 busy;               // threads running the stage function now
+};
+
+namespace xx {
+template<typename T>
+class StageFunction {
+  public:
+    StageFunction() {
+    }
+
+    virtual ~StageFunction() {
+    }
+
+    virtual void Run(std::vector<T>* batch) = 0;
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(StageFunction);
+};
+
+template<typename T, typename F>
+class StageFunctionImpl : public StageFunction<T> {
+  public:
+    explicit StageFunctionImpl(F f)
+        : _f(f) {
+    }
+
+    virtual ~StageFunctionImpl() {
+    }
+
+    virtual void Run(std::vector<T>* batch) {
+        _f(batch);
+    }
+
+  private:
+    F _f;
+};
+
+template<typename T>
+struct Stage {
+    Stage(const std::string& name, StageFunction<T>* fn, const StageOptions& opt)
+        : name(name), fn(fn), opt(opt), q(opt.queue_size),
+          in(0), out(0), dropped(0), batches(0) {
+    }
+
+    ~Stage() {
+        for (::size_t i = 0; i < threads.size(); ++i) {
+            delete threads[i];
+        }
+    }
+
+    std::string name;
+    scoped_ptr<StageFunction<T> > fn;
+    StageOptions opt;
+    BlockingMpmcQueue<T> q;
+    std::vector<Thread*> threads;
+
+    // updated with relaxed atomic adds
+    uint64 in;
+    uint64 out;
+    uint64 dropped;
+    uint64 batches;
+    atomic_t busy;
+};
+} // namespace xx
+
+template<typename T>
+class Pipeline {
+  public:
+    explicit Pipeline(void (*drop)(const T&) = NULL)
+        : _drop(drop), _started(false) {
+    }
+
+    ~Pipeline() {
+        this->Stop();
+        for (::size_t i = 0; i < _stages.size(); ++i) {
+            delete _stages[i];
+        }
+    }
+
+    /*
+     * f: void(std::vector<T>* batch), called in threads of the stage.
+     * add stages before Start().
+     */
+    template<typename F>
+    void AddStage(const std::string& name, F f,
+                  const StageOptions& opt = StageOptions()) {
+        CHECK(!_started);
+        CHECK_GT(opt.parallelism, 0);
+        CHECK_GT(opt.batch_size, 0);
+        _stages.push_back(new xx::Stage<T>(
+            name, new xx::StageFunctionImpl<T, F>(f), opt));
+    }
+
+    // threads are named after their stage
+    void Start() {
+        CHECK(!_started);
+        CHECK(!_stages.empty());
+        _started = true;
+
+        for (uint32 i = 0; i < _stages.size(); ++i) {
+            xx::Stage<T>* s = _stages[i];
+            ThreadOptions opt;
+            opt.name = s->name;
+
+            for (uint32 k = 0; k < s->opt.parallelism; ++k) {
+                Thread* t = new Thread(this, &Pipeline::Work, i);
+                CHECK(t->Start(opt));
+                s->threads.push_back(t);
+            }
+        }
+    }
+
+    /*
+     * stop after items already pushed went through all stages.
+     * no Push() is allowed during or after Stop().
+     */
+    void Stop() {
+        if (!_started) return;
+        _started = false;
+
+        for (::size_t i = 0; i < _stages.size(); ++i) {
+            xx::Stage<T>* s = _stages[i];
+            s->q.Close();
+            for (::size_t k = 0; k < s->threads.size(); ++k) {
+                s->threads[k]->Join();
+                delete s->threads[k];
+            }
+            s->threads.clear();
+        }
+    }
+
+    /*
+     * push an item into the first stage.
+     * return false if it is dropped, see StageOptions::shed.
+     */
+    bool Push(const T& v) {
+        return this->Send(_stages[0], &v, 1) == 1;
+    }
+
+    // return number of items not dropped
+    uint32 PushBatch(const T* v, uint32 n) {
+        return this->Send(_stages[0], v, n);
+    }
+
+    uint32 size() const {
+        return static_cast<uint32>(_stages.size());
+    }
+
+    void Stats(std::vector<StageStats>* v) {
+        v->resize(_stages.size());
+        for (::size_t i = 0; i < _stages.size(); ++i) {
+            xx::Stage<T>* s = _stages[i];
+            StageStats& x = (*v)[i];
+            x.name = s->name;
+            x.in = __atomic_load_n(&s->in, __ATOMIC_RELAXED);
+            x.out = __atomic_load_n(&s->out, __ATOMIC_RELAXED);
+            x.dropped = __atomic_load_n(&s->dropped, __ATOMIC_RELAXED);
+            x.batches = __atomic_load_n(&s->batches, __ATOMIC_RELAXED);
+            x.queued = s->q.queue().size();
+            x.capacity = s->q.queue().capacity();
+            x.busy = s->busy.value();
+        }
+    }
+
+  private:
+    std::vector<xx::Stage<T>*> _stages;
+    void (*_drop)(const T&);
+    bool _started;
+
+    // push items into the input queue of stage s, return number of items
+    // not dropped
+    uint32 Send(xx::Stage<T>* s, const T* v, uint32 n) {
+        uint32 sent = n;
+
+        if (!s->opt.shed) {
+            s->q.PushBatch(v, n);
+        } else {
+            sent = 0;
+            while (sent < n) {
+                uint32 k = s->q.TryPushBatch(v + sent, n - sent);
+                if (k == 0) break;
+                sent += k;
+            }
+
+            if (sent < n) {
+                __atomic_fetch_add(&s->dropped, n - sent, __ATOMIC_RELAXED);
+                if (_drop != NULL) {
+                    for (uint32 i = sent; i < n; ++i) _drop(v[i]);
+                }
+            }
+        }
+
+        if (sent > 0) __atomic_fetch_add(&s->in, sent, __ATOMIC_RELAXED);
+        return sent;
+    }
+
+    // thread of stage i
+    void Work(uint32 i) {
+        xx::Stage<T>* s = _stages[i];
+        xx::Stage<T>* next = i + 1 < _stages.size() ? _stages[i + 1] : NULL;
+
+        std::vector<T> buf(s->opt.batch_size);
+        std::vector<T> batch;
+        batch.reserve(s->opt.batch_size);
+
+        while (true) {
+            uint32 n = s->q.PopBatch(&buf[0], s->opt.batch_size);
+            if (n == 0) break;  // closed by Stop()
+
+            batch.assign(buf.begin(), buf.begin() + n);
+            s->busy.Inc();
+            s->fn->Run(&batch);
+            s->busy.Dec();
+
+            uint32 m = static_cast<uint32>(batch.size());
+            __atomic_fetch_add(&s->batches, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&s->out, m, __ATOMIC_RELAXED);
+            if (next != NULL && m > 0) this->Send(next, &batch[0], m);
+        }
+    }
+
+    DISALLOW_COPY_AND_ASSIGN(Pipeline);
+};
@@ -0,0 +1,63 @@
+#include "queue_lock.h"
+#include <cclog/cclog.h>
+
+namespace xx {
+/*
+ * nodes of one thread. a thread needs one node for every McsLock it holds or
+ * waits for, more than NODES of them are allocated on the heap.
+ */
+class alignas(CACHE_LINE_SIZE) McsNodes {
+  public:
+    McsNodes()
+        : _free(NULL) {
+        for (int i = 0; i < NODES; ++i) {
+            _nodes[i].home = this;
+            this->Free(&_nodes[i]);
+        }
+    }
+
+    ~McsNodes() {
+        while (_free != NULL) {
+            McsNode* n = _free;
+            _free = n->next;
+            if (n < _nodes || n >= _nodes + NODES) delete n;
+        }
+    }
+
+    McsNode* New() {
+        if (_free == NULL) {
+            McsNode* n = new McsNode;
+            n->home = this;
+            return n;
+        }
+
+        McsNode* n = _free;
+        _free = n->next;
+        return n;
+    }
+
+    void Free(McsNode* n) {
+        DCHECK(n->home == this);  // McsLock unlocked by another thread
+        n->next = _free;
+        _free = n;
+    }
+
+  private:
+    enum { NODES = 8 };
+    McsNode _nodes[NODES];
+    McsNode* _free;
+};
+
+static McsNodes* GetMcsNodes() {
+    static thread_local McsNodes kNodes;
+    return &kNodes;
+}
+
+McsNode* NewMcsNode() {
+    return GetMcsNodes()->New();
+}
+
+void FreeMcsNode(McsNode* n) {
+    GetMcsNodes()->Free(n);
+}
+} // namespace xx
@@ -0,0 +1,195 @@
+#pragma once
+
+#include "data_types.h"
+#include "spin_lock.h"
+
+/*
+ * Fair spin locks: threads get the lock in the order they arrive, so none is
+ * starved and the wait is bounded by the number of threads ahead.
+ *
+ *   McsLock: waiters form a queue, each spinning on a node of its own cache
+ *   line. UnLock() hands the lock to the next waiter with one store to its
+ *   node, so a release invalidates only one other cpu's cache line.
+ *
+ *   TicketLock: take a ticket, wait until it is served. Cheaper than McsLock
+ *   with a few threads, but all waiters spin on the same line.
+ *
+ *   Both are spin locks, for short critical sections with no more threads
+ *   than cpus. Waiters give up the cpu after spinning for a while.
+ *
+ *   A McsLock must be unlocked by the thread that locked it: its queue node
+ *   belongs to that thread (checked in debug builds).
+ *
+ *   McsLock l;
+ *   ScopedMcsLock g(l);
+ *
+ *   TicketLock t;
+ *   ScopedTicketLock h(t);
+ */
+namespace xx {
+// a cache line in size, aligned when it is not allocated on the heap
+struct McsNode {
+    McsNode* next;
+    void* home;                // nodes of the thread the node belongs to
+    uint32 locked;
+    char pad[CACHE_LINE_SIZE - 2 * sizeof(void*) - sizeof(uint32)];
+};
+
+// a free node of the calling thread
+McsNode* NewMcsNode();
+
+// give a node back to the calling thread, which must be its owner
+void FreeMcsNode(McsNode* n);
+} // namespace xx
+
+class alignas(CACHE_LINE_SIZE) McsLock {
+  public:
+    McsLock()
+        : _tail(NULL), _owner(NULL) {
+    }
+
+    ~McsLock() {
+    }
+
+    void Lock() {
+        xx::McsNode* n = xx::NewMcsNode();
+        n->next = NULL;
+        n->locked = 1;
+
+        xx::McsNode* prev = __atomic_exchange_n(&_tail, n, __ATOMIC_ACQ_REL);
+        if (prev != NULL) {
+            __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+
+            xx::Backoff b;
+            while (__atomic_load_n(&n->locked, __ATOMIC_ACQUIRE) != 0) b.Pause();
+        }
+
+        _owner = n;
+    }
+
+    bool TryLock() {
+        xx::McsNode* n = xx::NewMcsNode();
+        n->next = NULL;
+
+        xx::McsNode* x = NULL;
+        if (!__atomic_compare_exchange_n(&_tail, &x, n, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            xx::FreeMcsNode(n);
+            return false;
+        }
+
+        _owner = n;
+        return true;
+    }
+
+    void UnLock() {
+        xx::McsNode* n = _owner;
+        xx::McsNode* next = __atomic_load_n(&n->next, __ATOMIC_ACQUIRE);
+
+        if (next == NULL) {
+            xx::McsNode* x = n;
+            if (__atomic_compare_exchange_n(&_tail, &x, NULL, false,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+                xx::FreeMcsNode(n);
+                return;
+            }
+
+            // a new waiter has taken the tail, but not linked itself yet
+            while ((next = __atomic_load_n(&n->next, __ATOMIC_ACQUIRE)) == NULL) {
+                xx::CpuRelax();
+            }
+        }
+
+        __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+        xx::FreeMcsNode(n);
+    }
+
+  private:
+    xx::McsNode* _tail;        // the last waiter, NULL if free
+    xx::McsNode* _owner;       // node of the holder
+
+    DISALLOW_COPY_AND_ASSIGN(McsLock);
+};
+
+class alignas(CACHE_LINE_SIZE) TicketLock {
+  public:
+    TicketLock()
+        : _next(0), _serving(0) {
+    }
+
+    ~TicketLock() {
+    }
+
+    void Lock() {
+        uint32 t = __atomic_fetch_add(&_next, 1, __ATOMIC_RELAXED);
+
+        for (uint32 i = 0; ; ++i) {
+            uint32 s = __atomic_load_n(&_serving, __ATOMIC_ACQUIRE);
+            if (s == t) return;
+
+            // back off in proportion to the number of threads ahead
+            if (i < MAX_ROUNDS) {
+                for (uint32 k = (t - s) * SPINS_PER_WAITER; k > 0; --k) {
+                    xx::CpuRelax();
+                }
+            } else {
+                xx::CpuYield();
+            }
+        }
+    }
+
+    bool TryLock() {
+        uint32 s = __atomic_load_n(&_serving, __ATOMIC_ACQUIRE);
+        uint32 t = s;
+        return __atomic_compare_exchange_n(&_next, &t, s + 1, false,
+                                           __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    }
+
+    void UnLock() {
+        uint32 s = __atomic_load_n(&_serving, __ATOMIC_RELAXED);
+        __atomic_store_n(&_serving, s + 1, __ATOMIC_RELEASE);
+    }
+
+  private:
+    enum { SPINS_PER_WAITER = 32, MAX_ROUNDS = 64 };
+
+    uint32 _next;              // next ticket to take
+    char _pad[CACHE_LINE_SIZE - sizeof(uint32)];
+    uint32 _serving;           // ticket holding the lock
+
+    DISALLOW_COPY_AND_ASSIGN(TicketLock);
+};
+
+class ScopedMcsLock {
+  public:
+    explicit ScopedMcsLock(McsLock& lock)
+        : _lock(lock) {
+        _lock.Lock();
+    }
+
+    ~ScopedMcsLock() {
+        _lock.UnLock();
+    }
+
+  private:
+    McsLock& _lock;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedMcsLock);
+};
+
+class ScopedTicketLock {
+  public:
+    explicit ScopedTicketLock(TicketLock& lock)
+        : _lock(lock) {
+        _lock.Lock();
+    }
+
+    ~ScopedTicketLock() {
+        _lock.UnLock();
+    }
+
+  private:
+    TicketLock& _lock;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedTicketLock);
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "data_types.h"
+#include "spin_lock.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <type_traits>
+
+/*
+ * SeqLock<T>: a small value read by many threads and written rarely.
+ *
+ *   Readers never write shared memory: they read the sequence, copy the
+ *   value, and read the sequence again, retrying if a write was in progress
+ *   or happened in between. Writers are serialized by a SpinLock, make the
+ *   sequence odd, store the value and make it even again. Readers never
+ *   block writers, but they spin while a write is in progress.
+ *
+ *   T must be trivially copyable, and small, as readers copy all of it.
+ *
+ *   SeqLock<Leader> l;
+ *   Leader x = l.Load();
+ *   l.Store(x);
+ *   l.Update([](Leader* x) { ++x->term; });    // read-modify-write
+ */
+template<typename T>
+class SeqLock {
+  public:
+    static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+
+    SeqLock()
+        : _seq(0) {
+        this->Write(T());
+    }
+
+    explicit SeqLock(const T& v)
+        : _seq(0) {
+        this->Write(v);
+    }
+
+    ~SeqLock() {
+    }
+
+    T Load() const {
+        T v;
+        this->Load(&v);
+        return v;
+    }
+
+    void Load(T* v) const {
+        uintptr_t x[WORDS];
+        xx::Backoff b;
+
+        while (true) {
+            uint32 s = __atomic_load_n(&_seq, __ATOMIC_ACQUIRE);
+            if ((s & 1) == 0) {
+                for (::size_t i = 0; i < WORDS; ++i) {
+                    x[i] = __atomic_load_n(&_data[i], __ATOMIC_RELAXED);
+                }
+
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&_seq, __ATOMIC_RELAXED) == s) break;
+            }
+            b.Pause();  // a write is in progress
+        }
+
+        ::memcpy(v, x, sizeof(T));
+    }
+
+    void Store(const T& v) {
+        _lock.Lock();
+        this->Write(v);
+        _lock.UnLock();
+    }
+
+    // f(T*) modifies the value, writers are blocked meanwhile
+    template<typename F>
+    void Update(F f) {
+        _lock.Lock();
+        T v;
+        ::memcpy(&v, _data, sizeof(T));  // no other writer, no race
+        f(&v);
+        this->Write(v);
+        _lock.UnLock();
+    }
+
+    // even, increased by 2 on every write
+    uint32 version() const {
+        return __atomic_load_n(&_seq, __ATOMIC_ACQUIRE);
+    }
+
+  private:
+    enum { WORDS = (sizeof(T) + sizeof(uintptr_t) - 1) / sizeof(uintptr_t) };
+
+    uint32 _seq;               // odd while a write is in progress
+    uintptr_t _data[WORDS];
+    SpinLock _lock;
+
+    // called by one writer at a time
+    void Write(const T& v) {
+        uintptr_t x[WORDS] = { 0 };
+        ::memcpy(x, &v, sizeof(T));
+
+        uint32 s = __atomic_load_n(&_seq, __ATOMIC_RELAXED);
+        __atomic_store_n(&_seq, s + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        for (::size_t i = 0; i < WORDS; ++i) {
+            __atomic_store_n(&_data[i], x[i], __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&_seq, s + 2, __ATOMIC_RELEASE);
+    }
+
+    DISALLOW_COPY_AND_ASSIGN(SeqLock);
+};
@@ -0,0 +1,22 @@
+#include "sharded_counter.h"
+#include "atomic.h"
+#include "cpu_topology.h"
+
+namespace xx {
+static uint32 PowerOf2CpuNum() {
+    uint32 x = 1;
+    uint32 n = static_cast<uint32>(CpuTopology::AvailableCpuNum());
+    while (x < n) x <<= 1;
+    return x;
+}
+
+uint32 DefaultShardNum() {
+    static uint32 kNum = PowerOf2CpuNum();   // thread safe since C++11
+    return kNum;
+}
+
+uint32 NewShardIndex() {
+    static atomic_t kNext;
+    return kNext.Inc() - 1;
+}
+} // namespace xx
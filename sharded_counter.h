@@ -0,0 +1,229 @@
+#pragma once
+
+#include "data_types.h"
+
+#include <stddef.h>
+#include <limits>
+#include <type_traits>
+
+/*
+ * Counters for hot paths updated by many threads.
+ *
+ *   A single atomic_t puts every thread on the same cache line. These
+ *   counters spread updates over shards, each on its own cache line, and a
+ *   thread always updates the same shard. Reading a value sums (or takes the
+ *   max/min of) all shards, so reads are slower and only approximate while
+ *   updates go on.
+ *
+ *   By default there is one shard for each cpu.
+ *
+ *   ShardedCounter c;      // uint64
+ *   c.Inc();
+ *   c.Add(10);
+ *   uint64 n = c.value();
+ *
+ *   ShardedAdder a;        // int64
+ *   a.Add(-3);
+ *
+ *   ShardedMax<int64> m;   // gauge, ShardedMin<int64> likewise
+ *   m.Update(latency);
+ *   int64 x = m.value();   // max since construction or Reset()
+ */
+namespace xx {
+// number of cpus rounded up to a power of 2
+uint32 DefaultShardNum();
+
+// a new index for the calling thread, threads get 0, 1, 2...
+uint32 NewShardIndex();
+
+inline uint32 ShardIndex() {
+    static thread_local uint32 kIndex = 0;   // index + 1, 0 if not assigned
+    if (kIndex == 0) kIndex = NewShardIndex() + 1;
+    return kIndex - 1;
+}
+
+// T values in cache line sized and aligned slots
+template<typename T>
+class Shards {
+  public:
+    Shards(uint32 n, T init) {
+        if (n == 0) n = DefaultShardNum();
+        uint32 x = 1;
+        while (x < n) x <<= 1;
+        _mask = x - 1;
+
+        // one more line for the alignment
+        _buf = new char[CACHE_LINE_SIZE * (x + 1)];
+        uintptr_t p = reinterpret_cast<uintptr_t>(_buf);
+        p = (p + CACHE_LINE_SIZE - 1) & ~static_cast<uintptr_t>(CACHE_LINE_SIZE - 1);
+        _slots = reinterpret_cast<char*>(p);
+
+        for (uint32 i = 0; i < x; ++i) *this->at(i) = init;
+    }
+
+    ~Shards() {
+        delete[] _buf;
+    }
+
+    uint32 size() const {
+        return _mask + 1;
+    }
+
+    T* at(uint32 i) const {
+        return reinterpret_cast<T*>(_slots + CACHE_LINE_SIZE * i);
+    }
+
+    // shard of the calling thread
+    T* local() const {
+        return this->at(ShardIndex() & _mask);
+    }
+
+  private:
+    char* _buf;
+    char* _slots;
+    uint32 _mask;
+
+    DISALLOW_COPY_AND_ASSIGN(Shards);
+};
+
+template<typename T>
+class ShardedSum {
+  public:
+    explicit ShardedSum(uint32 shards)
+        : _s(shards, 0) {
+    }
+
+    ~ShardedSum() {
+    }
+
+    void Add(T v) {
+        __atomic_fetch_add(_s.local(), v, __ATOMIC_RELAXED);
+    }
+
+    T value() const {
+        T sum = 0;
+        for (uint32 i = 0; i < _s.size(); ++i) {
+            sum += __atomic_load_n(_s.at(i), __ATOMIC_RELAXED);
+        }
+        return sum;
+    }
+
+    // updates during Reset() may be lost
+    void Reset() {
+        for (uint32 i = 0; i < _s.size(); ++i) {
+            __atomic_store_n(_s.at(i), 0, __ATOMIC_RELAXED);
+        }
+    }
+
+  private:
+    Shards<T> _s;
+
+    DISALLOW_COPY_AND_ASSIGN(ShardedSum);
+};
+
+// keep max (greater == true) or min of values, integers only, as the
+// __atomic_*_n builtins
+template<typename T, bool greater>
+class ShardedExtreme {
+  public:
+    static_assert(std::is_integral<T>::value, "T must be an integer type");
+
+    explicit ShardedExtreme(uint32 shards)
+        : _s(shards, Init()) {
+    }
+
+    ~ShardedExtreme() {
+    }
+
+    // CAS only if v beats the value of the shard
+    void Update(T v) {
+        T* p = _s.local();
+        T x = __atomic_load_n(p, __ATOMIC_RELAXED);
+        while (Better(v, x)) {
+            if (__atomic_compare_exchange_n(p, &x, v, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+    }
+
+    // numeric_limits<T>::lowest() for max, max() for min, if never updated
+    T value() const {
+        T r = Init();
+        for (uint32 i = 0; i < _s.size(); ++i) {
+            T x = __atomic_load_n(_s.at(i), __ATOMIC_RELAXED);
+            if (Better(x, r)) r = x;
+        }
+        return r;
+    }
+
+    // updates during Reset() may be lost
+    void Reset() {
+        for (uint32 i = 0; i < _s.size(); ++i) {
+            __atomic_store_n(_s.at(i), Init(), __ATOMIC_RELAXED);
+        }
+    }
+
+  private:
+    Shards<T> _s;
+
+    static T Init() {
+        return greater ? std::numeric_limits<T>::lowest() : std::numeric_limits<T>::max();
+    }
+
+    static bool Better(T a, T b) {
+        return greater ? a > b : a < b;
+    }
+
+    DISALLOW_COPY_AND_ASSIGN(ShardedExtreme);
+};
+} // namespace xx
+
+// unsigned 64 bit counter
+class ShardedCounter : public xx::ShardedSum<uint64> {
+  public:
+    // shards == 0: one for each cpu
+    explicit ShardedCounter(uint32 shards = 0)
+        : xx::ShardedSum<uint64>(shards) {
+    }
+
+    void Inc() {
+        this->Add(1);
+    }
+};
+
+// signed 64 bit adder
+class ShardedAdder : public xx::ShardedSum<int64> {
+  public:
+    explicit ShardedAdder(uint32 shards = 0)
+        : xx::ShardedSum<int64>(shards) {
+    }
+
+    void Inc() {
+        this->Add(1);
+    }
+
+    void Dec() {
+        this->Add(-1);
+    }
+
+    void Sub(int64 v) {
+        this->Add(-v);
+    }
+};
+
+template<typename T>
+class ShardedMax : public xx::ShardedExtreme<T, true> {
+  public:
+    explicit ShardedMax(uint32 shards = 0)
+        : xx::ShardedExtreme<T, true>(shards) {
+    }
+};
+
+template<typename T>
+class ShardedMin : public xx::ShardedExtreme<T, false> {
+  public:
+    explicit ShardedMin(uint32 shards = 0)
+        : xx::ShardedExtreme<T, false>(shards) {
+    }
+};
@@ -1,26 +1,192 @@
 #pragma once
 
-#include "atomic.h"
+#include "data_types.h"
+#include "futex.h"
+#include "lock_profiler.h"
 
-class SpinLock {
+#ifndef _WIN32
+#  include <sched.h>
+#else
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#endif
+
+namespace xx {
+// hint the cpu that we are spinning
+inline void CpuRelax() {
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#elif defined(_WIN32)
+    ::YieldProcessor();
+#endif
+}
+
+inline void CpuYield() {
+#ifndef _WIN32
+    ::sched_yield();
+#else
+    ::SwitchToThread();
+#endif
+}
+
+/*
+ * exponential backoff: Pause() spins 1, 2, 4 ... MAX_SPINS times, then gives
+ * up the cpu on every call.
+ */
+class Backoff {
   public:
-    SpinLock() {
+    Backoff()
+        : _n(1) {
+    }
+
+    void Pause() {
+        if (_n <= MAX_SPINS) {
+            for (uint32 i = 0; i < _n; ++i) CpuRelax();
+            _n <<= 1;
+        } else {
+            CpuYield();
+        }
+    }
+
+    void Reset() {
+        _n = 1;
     }
+
+  private:
+    enum { MAX_SPINS = 1024 };
+    uint32 _n;
+};
+} // namespace xx
+
+/*
+ * SpinLock: test and test-and-set lock for short critical sections.
+ *
+ *   Waiters read the lock word, which stays in their cache until it is
+ *   released, and try the atomic exchange only when it looks free. Between
+ *   reads they back off with pause and, after a while, sched_yield. The lock
+ *   is released with a plain release store, and it fills a cache line of its
+ *   own, so neighbouring data is not invalidated along with it.
+ *
+ *   SpinLock l;
+ *   l.Lock();
+ *   l.UnLock();
+ */
+class alignas(CACHE_LINE_SIZE) SpinLock {
+  public:
+    SpinLock()
+        : _lock(0) {
+    }
+
     ~SpinLock() {
+        LOCK_PROFILE_DESTROY();
+    }
+
+    bool TryLock() {
+        bool ok = __atomic_load_n(&_lock, __ATOMIC_RELAXED) == 0 && this->Acquire();
+        return LOCK_PROFILE_TRY(xx::LOCK_SPIN, ok);
+    }
+
+    void Lock() {
+        LOCK_PROFILE_LOCK(xx::LOCK_SPIN, this->Acquire(), this->RawLock());
+    }
+
+    void UnLock() {
+        LOCK_PROFILE_UNLOCK();
+        __atomic_store_n(&_lock, 0, __ATOMIC_RELEASE);
+    }
+
+  private:
+    uint32 _lock;
+
+    bool Acquire() {
+        return __atomic_exchange_n(&_lock, 1, __ATOMIC_ACQUIRE) == 0;
+    }
+
+    void RawLock() {
+        if (!this->Acquire()) this->LockSlow();
+    }
+
+    void LockSlow() {
+        xx::Backoff b;
+        do {
+            while (__atomic_load_n(&_lock, __ATOMIC_RELAXED) != 0) b.Pause();
+        } while (!this->Acquire());
+    }
+
+    DISALLOW_COPY_AND_ASSIGN(SpinLock);
+};
+
+/*
+ * AdaptiveSpinLock: spins up to a budget, then sleeps on a futex.
+ *
+ *   For critical sections that are usually short but may be long, or when
+ *   there are more threads than cpus. The lock word is 0 (free), 1 (locked)
+ *   or 2 (locked, maybe with sleepers), so UnLock() enters the kernel only
+ *   if someone may be sleeping. Without futex, it falls back to sched_yield.
+ *
+ *   AdaptiveSpinLock l(200);     // spin up to 200 rounds before sleeping
+ */
+class alignas(CACHE_LINE_SIZE) AdaptiveSpinLock {
+  public:
+    explicit AdaptiveSpinLock(uint32 spins = 100)
+        : _state(0), _spins(spins) {
+    }
+
+    ~AdaptiveSpinLock() {
+        LOCK_PROFILE_DESTROY();
     }
 
     bool TryLock() {
-        return _lock.CompareSwap(0, 1);
+        return LOCK_PROFILE_TRY(xx::LOCK_ADAPTIVE_SPIN, this->RawTryLock());
     }
 
     void Lock() {
-        while (!this->TryLock());
+        LOCK_PROFILE_LOCK(xx::LOCK_ADAPTIVE_SPIN, this->RawTryLock(), this->RawLock());
     }
 
     void UnLock() {
-        _lock.And(0);
+        LOCK_PROFILE_UNLOCK();
+        if (__atomic_exchange_n(&_state, 0, __ATOMIC_RELEASE) == 2) {
+#ifdef __linux__
+            xx::FutexWake(&_state, 1);
+#endif
+        }
     }
 
   private:
-    atomic_t _lock;
+    uint32 _state;
+    const uint32 _spins;
+
+    bool RawTryLock() {
+        uint32 v = 0;
+        return __atomic_compare_exchange_n(&_state, &v, 1, false,
+                                           __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    }
+
+    void RawLock() {
+        if (!this->RawTryLock()) this->LockSlow();
+    }
+
+    void LockSlow() {
+        for (uint32 i = 0; i < _spins; ++i) {
+            uint32 s = __atomic_load_n(&_state, __ATOMIC_RELAXED);
+            if (s == 0 && this->RawTryLock()) return;
+            if (s == 2) break;  // others are sleeping already
+            xx::CpuRelax();
+        }
+
+        // mark the lock contended, whoever unlocks it will wake one up
+#ifdef __linux__
+        while (__atomic_exchange_n(&_state, 2, __ATOMIC_ACQUIRE) != 0) {
+            xx::FutexWait(&_state, 2);
+        }
+#else
+        xx::Backoff b;
+        while (__atomic_exchange_n(&_state, 2, __ATOMIC_ACQUIRE) != 0) b.Pause();
+#endif
+    }
+
+    DISALLOW_COPY_AND_ASSIGN(AdaptiveSpinLock);
 };
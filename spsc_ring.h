@@ -0,0 +1,155 @@
+#pragma once
+
+#include "data_types.h"
+
+#include <new>
+#include <utility>
+
+/*
+ * SpscRing: wait-free ring for one producer thread and one consumer thread.
+ *
+ *   The producer owns _head and the consumer owns _tail, each on its own
+ *   cache line together with a cached copy of the other index. The shared
+ *   index is read only when the cached one says the ring is full or empty.
+ *
+ *   Reserve()/Commit() and Peek()/Consume() work on slots in place: the
+ *   producer constructs elements directly in the ring and publishes them
+ *   with one release store, the consumer reads them there and frees the
+ *   slots with one release store.
+ *
+ *   SpscRing<Item> r(4096);           // capacity is rounded up to power of 2
+ *
+ *   // producer
+ *   r.TryPush(item);                  // false if full
+ *   r.Emplace(a, b);                  // construct Item(a, b) in the ring
+ *
+ *   Item* p;
+ *   uint32 n = r.Reserve(32, &p);     // up to 32 free slots, n may be 0
+ *   for (uint32 i = 0; i < n; ++i) new (p + i) Item(...);
+ *   r.Commit(n);                      // publish n elements at once
+ *
+ *   // consumer
+ *   r.TryPop(&item);                  // false if empty
+ *
+ *   n = r.Peek(32, &p);               // up to 32 elements
+ *   ...                               // use p[0] ... p[n - 1]
+ *   r.Consume(n);                     // destroy them, free the slots
+ */
+template<typename T>
+class SpscRing {
+  public:
+    explicit SpscRing(uint32 capacity) {
+        uint32 n = 2;
+        while (n < capacity) n <<= 1;
+
+        _mask = n - 1;
+        _slots = static_cast<T*>(::operator new(sizeof(T) * n));
+        _head = _tail = 0;
+        _cached_head = _cached_tail = 0;
+    }
+
+    ~SpscRing() {
+        for (uint64 i = _tail; i != _head; ++i) {
+            _slots[i & _mask].~T();
+        }
+        ::operator delete(_slots);
+    }
+
+    uint32 capacity() const {
+        return _mask + 1;
+    }
+
+    // approximate if called by neither the producer nor the consumer
+    uint32 size() const {
+        uint64 h = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+        uint64 t = __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+        return h > t ? static_cast<uint32>(h - t) : 0;
+    }
+
+    /*
+     * producer: get up to n free slots in a row, *p points to the first one.
+     *   the slots are raw memory, construct elements with placement new.
+     *   return number of slots, 0 if the ring is full. fewer than n may be
+     *   returned at the end of the ring even if there is more free space.
+     */
+    uint32 Reserve(uint32 n, T** p) {
+        uint64 cap = _mask + 1;
+        if (_head + n - _cached_tail > cap) {
+            _cached_tail = __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+        }
+
+        uint64 free = cap - (_head - _cached_tail);
+        uint64 end = cap - (_head & _mask);    // slots before wrapping around
+        if (free > end) free = end;
+        if (free > n) free = n;
+
+        *p = _slots + (_head & _mask);
+        return static_cast<uint32>(free);
+    }
+
+    // producer: publish n elements constructed in reserved slots
+    void Commit(uint32 n) {
+        __atomic_store_n(&_head, _head + n, __ATOMIC_RELEASE);
+    }
+
+    /*
+     * consumer: get up to n elements in a row, *p points to the first one.
+     *   return number of elements, 0 if the ring is empty.
+     */
+    uint32 Peek(uint32 n, T** p) {
+        if (_tail + n > _cached_head) {
+            _cached_head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+        }
+
+        uint64 used = _cached_head - _tail;
+        uint64 end = (_mask + 1) - (_tail & _mask);
+        if (used > end) used = end;
+        if (used > n) used = n;
+
+        *p = _slots + (_tail & _mask);
+        return static_cast<uint32>(used);
+    }
+
+    // consumer: destroy n elements got by Peek(), and free their slots
+    void Consume(uint32 n) {
+        for (uint32 i = 0; i < n; ++i) {
+            _slots[(_tail + i) & _mask].~T();
+        }
+        __atomic_store_n(&_tail, _tail + n, __ATOMIC_RELEASE);
+    }
+
+    template<typename... A>
+    bool Emplace(A&&... a) {
+        T* p;
+        if (this->Reserve(1, &p) == 0) return false;
+        new (p) T(std::forward<A>(a)...);
+        this->Commit(1);
+        return true;
+    }
+
+    bool TryPush(const T& v) {
+        return this->Emplace(v);
+    }
+
+    bool TryPop(T* v) {
+        T* p;
+        if (this->Peek(1, &p) == 0) return false;
+        *v = std::move(*p);
+        this->Consume(1);
+        return true;
+    }
+
+  private:
+    T* _slots;
+    uint32 _mask;
+
+    char _pad0[CACHE_LINE_SIZE];
+    uint64 _head;              // written by the producer
+    uint64 _cached_tail;       // the producer's copy of _tail
+    char _pad1[CACHE_LINE_SIZE - sizeof(uint64) * 2];
+    uint64 _tail;              // written by the consumer
+    uint64 _cached_head;       // the consumer's copy of _head
+    char _pad2[CACHE_LINE_SIZE - sizeof(uint64) * 2];
+
+    DISALLOW_COPY_AND_ASSIGN(SpscRing);
+};
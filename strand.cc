@@ -0,0 +1,73 @@
+#include "strand.h"
+
+static thread_local const Strand* xStrand = NULL;   // strand running now
+
+Strand::Strand(Executor* e)
+    : _executor(e) {
+    CHECK(e != NULL);
+    _drain.reset(NewPermanentCallback(this, &Strand::Drain));
+    _head = _tail = new Node();
+    _head->c = NULL;
+    _head->next = NULL;
+}
+
+Strand::~Strand() {
+    DCHECK(_pending.value() == 0);
+    while (_head != NULL) {
+        Node* n = _head->next;
+        delete _head;
+        _head = n;
+    }
+}
+
+void Strand::Post(Closure* c) {
+    Node* n = new Node();
+    n->c = c;
+    n->next = NULL;
+
+    Node* prev = __atomic_exchange_n(&_tail, n, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+
+    // the first pending closure schedules the drain
+    if (_pending.Inc() == 1) _executor->Post(_drain.get());
+}
+
+bool Strand::InStrand() const {
+    return xStrand == this;
+}
+
+Strand::Node* Strand::Pop() {
+    Node* next = __atomic_load_n(&_head->next, __ATOMIC_ACQUIRE);
+    if (next == NULL) return NULL;
+
+    delete _head;
+    _head = next;
+    return next;
+}
+
+/*
+ * _pending drops to 0 only after the last closure has run, and a Post()
+ * schedules the drain only when it raises _pending from 0, so there is never
+ * more than one drain running or queued.
+ */
+void Strand::Drain() {
+    const Strand* prev = xStrand;
+    xStrand = this;
+
+    for (uint32 i = 0; i < MAX_BATCH; ++i) {
+        Node* n = this->Pop();
+        if (n == NULL) break;   // a Post() has not linked its node yet
+
+        Closure* c = n->c;
+        n->c = NULL;
+        c->Run();
+
+        if (_pending.Dec() == 0) {
+            xStrand = prev;
+            return;
+        }
+    }
+
+    xStrand = prev;
+    _executor->Post(_drain.get());
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "data_types.h"
+#include "atomic.h"
+#include "closure.h"
+#include "executor.h"
+#include "scoped_ptr.h"
+
+/*
+ * Strand: run closures posted to it one at a time, in FIFO order, on another
+ * executor.
+ *
+ *   Objects touched only by closures of one strand need no lock. Post() is a
+ *   lock-free enqueue plus an atomic add, and at most one drain closure of the
+ *   strand is queued on the executor at a time, so many strands can share one
+ *   pool. No lock is held while closures run. After a batch of closures, the
+ *   strand goes back to the executor to let other work run.
+ *
+ *   The strand does not delete closures, see executor.h.
+ *
+ *   Strand s(&pool);
+ *   s.Post(NewCallback(&obj, &T::Handle, 7));
+ *   s.Post(&obj, &T::Handle, 8);     // runs after Handle(7) has returned
+ *
+ *   Destroy a strand only when nothing is pending on it.
+ */
+class Strand : public Executor {
+  public:
+    explicit Strand(Executor* e);
+
+    virtual ~Strand();
+
+    using Executor::Post;
+    virtual void Post(Closure* c);
+
+    // true if the calling thread is running a closure of this strand
+    bool InStrand() const;
+
+    // number of closures waiting or running
+    uint32 pending() {
+        return _pending.value();
+    }
+
+  private:
+    struct Node {
+        Closure* c;
+        Node* next;
+    };
+
+    enum {
+        MAX_BATCH = 64,    // closures to run before going back to the executor
+    };
+
+    Executor* _executor;
+    scoped_ptr<Closure> _drain;
+    atomic_t _pending;
+
+    // MPSC queue: producers swap _tail, the drain closure pops from _head.
+    // _head is a dummy node, the first closure is in _head->next.
+    Node* _head;
+    Node* _tail;
+
+    // run in the executor
+    void Drain();
+
+    // called by the drain closure only
+    Node* Pop();
+
+    DISALLOW_COPY_AND_ASSIGN(Strand);
+};
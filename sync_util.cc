@@ -0,0 +1,109 @@
+#include "sync_util.h"
+#include "futex.h"
+#include "spin_lock.h"
+#include "time_util.h"
+
+namespace xx {
+enum { SPINS = 100 };
+
+// sleep while *addr == v, at most us microseconds (0 for no limit)
+static inline void SleepOn(uint32* addr, uint32 v, uint64 us) {
+#ifdef __linux__
+    FutexWait(addr, v, us);
+#else
+    SleepInUs(us > 0 && us < 100 ? static_cast<uint32>(us) : 100);
+#endif
+}
+
+static inline void WakeOn(uint32* addr, int n) {
+#ifdef __linux__
+    FutexWake(addr, n);
+#endif
+}
+
+/*
+ * wait until ready(&v) is true, spinning a little before sleeping on addr.
+ * if not ready, ready() sets v to the value of *addr to sleep on.
+ * return false if timeout.
+ */
+template<typename F>
+static bool WaitFor(uint32* addr, uint32* waiters, uint64 us, F ready) {
+    uint32 v;
+    for (int i = 0; i < SPINS; ++i) {
+        if (ready(&v)) return true;
+        CpuRelax();
+    }
+
+    uint64 deadline = us > 0 ? NowInUs() + us : 0;
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+
+    bool ok;
+    while (!(ok = ready(&v))) {
+        uint64 left = 0;
+        if (deadline != 0) {
+            uint64 now = NowInUs();
+            if (now >= deadline) break;
+            left = deadline - now;
+        }
+        SleepOn(addr, v, left);
+    }
+
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_RELAXED);
+    return ok;
+}
+} // namespace xx
+
+bool Semaphore::Wait(uint64 us) {
+    return xx::WaitFor(&_count, &_waiters, us, [this](uint32* v) {
+        *v = 0;
+        return this->TryAcquire();
+    });
+}
+
+void Semaphore::Release(uint32 n) {
+    __atomic_add_fetch(&_count, n, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&_waiters, __ATOMIC_SEQ_CST) != 0) {
+        xx::WakeOn(&_count, n < 0x7fffffff ? static_cast<int>(n) : 0x7fffffff);
+    }
+}
+
+void CountDownLatch::CountDown(uint32 n) {
+    uint32 c = __atomic_load_n(&_count, __ATOMIC_RELAXED);
+    while (c > 0) {
+        uint32 x = c > n ? c - n : 0;
+        if (__atomic_compare_exchange_n(&_count, &c, x, true,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            if (x == 0 && __atomic_load_n(&_waiters, __ATOMIC_SEQ_CST) != 0) {
+                xx::WakeOn(&_count, 0x7fffffff);
+            }
+            return;
+        }
+    }
+}
+
+bool CountDownLatch::WaitZero(uint64 us) {
+    return xx::WaitFor(&_count, &_waiters, us, [this](uint32* v) {
+        *v = this->count();
+        return *v == 0;
+    });
+}
+
+bool Barrier::Wait() {
+    uint32 phase = __atomic_load_n(&_phase, __ATOMIC_ACQUIRE);
+
+    if (__atomic_add_fetch(&_arrived, 1, __ATOMIC_ACQ_REL) == _n) {
+        // threads of the next phase read the new phase before arriving
+        __atomic_store_n(&_arrived, 0, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&_phase, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&_waiters, __ATOMIC_SEQ_CST) != 0) {
+            xx::WakeOn(&_phase, 0x7fffffff);
+        }
+        return true;
+    }
+
+    xx::WaitFor(&_phase, &_waiters, 0, [this, phase](uint32* v) {
+        *v = phase;
+        return this->phase() != phase;
+    });
+    return false;
+}
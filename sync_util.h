@@ -0,0 +1,132 @@
+#pragma once
+
+#include "data_types.h"
+
+/*
+ * Semaphore, CountDownLatch and Barrier.
+ *
+ *   Counts are atomic words, so an acquire with permits available, a count
+ *   down, or a release nobody waits for costs no syscall. A thread that has
+ *   to wait spins for a while, then sleeps on a futex (polls on systems
+ *   without futex). Timeouts are in microseconds.
+ *
+ *   Semaphore sem(0);
+ *   sem.Release(8);                // wake up to 8 waiters
+ *   sem.Acquire();
+ *   sem.TimedAcquire(500);         // false if timeout
+ *
+ *   CountDownLatch latch(n);
+ *   latch.CountDown();             // in n workers
+ *   latch.Wait();
+ *
+ *   Barrier b(n);
+ *   b.Wait();                      // all n threads meet, then go on together
+ */
+class Semaphore {
+  public:
+    explicit Semaphore(uint32 count = 0)
+        : _count(count), _waiters(0) {
+    }
+
+    ~Semaphore() {
+    }
+
+    bool TryAcquire() {
+        uint32 c = __atomic_load_n(&_count, __ATOMIC_RELAXED);
+        while (c > 0) {
+            if (__atomic_compare_exchange_n(&_count, &c, c - 1, true,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Acquire() {
+        if (!this->TryAcquire()) this->Wait(0);
+    }
+
+    // return false if timeout
+    bool TimedAcquire(uint64 us) {
+        return this->TryAcquire() || (us > 0 && this->Wait(us));
+    }
+
+    void Release(uint32 n = 1);
+
+    uint32 value() const {
+        return __atomic_load_n(&_count, __ATOMIC_RELAXED);
+    }
+
+  private:
+    uint32 _count;
+    uint32 _waiters;
+
+    // us: 0 for no timeout
+    bool Wait(uint64 us);
+
+    DISALLOW_COPY_AND_ASSIGN(Semaphore);
+};
+
+class CountDownLatch {
+  public:
+    explicit CountDownLatch(uint32 count)
+        : _count(count), _waiters(0) {
+    }
+
+    ~CountDownLatch() {
+    }
+
+    // the count stops at 0
+    void CountDown(uint32 n = 1);
+
+    void Wait() {
+        if (this->count() != 0) this->WaitZero(0);
+    }
+
+    // return false if timeout
+    bool TimedWait(uint64 us) {
+        return this->count() == 0 || (us > 0 && this->WaitZero(us));
+    }
+
+    uint32 count() const {
+        return __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
+    }
+
+  private:
+    uint32 _count;
+    uint32 _waiters;
+
+    bool WaitZero(uint64 us);
+
+    DISALLOW_COPY_AND_ASSIGN(CountDownLatch);
+};
+
+/*
+ * Barrier: threads wait until n of them have arrived, then all go on and the
+ * barrier is ready for the next phase.
+ */
+class Barrier {
+  public:
+    explicit Barrier(uint32 n)
+        : _n(n), _arrived(0), _phase(0), _waiters(0) {
+    }
+
+    ~Barrier() {
+    }
+
+    // return true in the last thread arriving, false in others
+    bool Wait();
+
+    // number of completed phases
+    uint32 phase() const {
+        return __atomic_load_n(&_phase, __ATOMIC_ACQUIRE);
+    }
+
+  private:
+    const uint32 _n;
+    uint32 _arrived;
+    uint32 _phase;
+    uint32 _waiters;
+
+    DISALLOW_COPY_AND_ASSIGN(Barrier);
+};
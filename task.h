@@ -0,0 +1,481 @@
+#pragma once
+
+/*
+ * Coroutines, need C++20.
+ *
+ *   Task<T>:  a lazy coroutine. It runs when it is co_awaited, or started by
+ *             Start(executor), which returns a Future<T>. A task resumes on
+ *             the executor it was started on, and child tasks inherit it.
+ *
+ *   CoEvent, CoMutex, CoSleep: awaitable versions of SyncEvent, Mutex and
+ *             SleepInMs(). They suspend the task instead of blocking the
+ *             thread, and resume it on its executor.
+ *
+ *   Task<int> Fetch(int i) {
+ *       co_await CoSleep(&timer_wheel, 10);
+ *       co_return i * 2;
+ *   }
+ *
+ *   Task<int> Handle(CoEvent* ev, CoMutex* m) {
+ *       co_await *ev;                      // wait until ev->Notify()
+ *       int a = co_await Fetch(1);
+ *       int b = co_await Fetch(2);
+ *       co_await m->Lock();
+ *       ...
+ *       m->UnLock();
+ *       co_return a + b;
+ *   }
+ *
+ *   Future<int> f = Handle(&ev, &m).Start(&pool);
+ */
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+#include "data_types.h"
+#include "closure.h"
+#include "executor.h"
+#include "future.h"
+#include "thread_util.h"
+#include "timer_wheel.h"
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template<typename T> class Task;
+
+namespace xx {
+// resume h, deleted after run
+class ResumeCallback : public Closure {
+  public:
+    explicit ResumeCallback(std::coroutine_handle<> h)
+        : _h(h) {
+    }
+
+    virtual ~ResumeCallback() {
+    }
+
+    virtual void Run() {
+        std::coroutine_handle<> h = _h;
+        delete this;
+        h.resume();
+    }
+
+  private:
+    std::coroutine_handle<> _h;
+};
+
+// resume h on the executor, or in the calling thread if e is NULL
+inline void Resume(Executor* e, std::coroutine_handle<> h) {
+    if (e != NULL) {
+        e->Post(new ResumeCallback(h));
+    } else {
+        h.resume();
+    }
+}
+
+class TaskPromiseBase {
+  public:
+    TaskPromiseBase()
+        : executor(NULL), detached(false) {
+    }
+
+    std::suspend_always initial_suspend() noexcept {
+        return std::suspend_always();
+    }
+
+    void unhandled_exception() noexcept {
+        std::terminate();
+    }
+
+    Executor* executor;                      // where to resume
+    std::coroutine_handle<> continuation;    // the awaiting coroutine
+    bool detached;                           // started by Start()
+};
+
+// executor of the coroutine, NULL if it is not a Task
+template<typename P>
+inline Executor* ExecutorOf(std::coroutine_handle<P> h) {
+    if constexpr (std::is_base_of<TaskPromiseBase, P>::value) {
+        return h.promise().executor;
+    } else {
+        return NULL;
+    }
+}
+
+struct Waiter {
+    std::coroutine_handle<> h;
+    Executor* e;
+};
+
+// at the end of a task: go back to the awaiting coroutine, or free the frame
+template<typename P>
+struct FinalAwaiter {
+    bool await_ready() noexcept {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+        P& p = h.promise();
+        if (p.continuation) return p.continuation;
+        if (p.detached) h.destroy();
+        return std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {
+    }
+};
+
+template<typename T>
+class TaskPromise : public TaskPromiseBase {
+  public:
+    Task<T> get_return_object() noexcept;
+
+    FinalAwaiter<TaskPromise> final_suspend() noexcept {
+        return FinalAwaiter<TaskPromise>();
+    }
+
+    void return_value(const T& v) {
+        if (detached) {
+            result->SetValue(v);
+        } else {
+            value.reset(new T(v));
+        }
+    }
+
+    scoped_ptr<T> value;
+    scoped_ptr<Promise<T> > result;          // for detached task
+};
+
+template<>
+class TaskPromise<void> : public TaskPromiseBase {
+  public:
+    Task<void> get_return_object() noexcept;
+
+    FinalAwaiter<TaskPromise> final_suspend() noexcept {
+        return FinalAwaiter<TaskPromise>();
+    }
+
+    void return_void() {
+        if (detached) result->SetValue();
+    }
+
+    scoped_ptr<Promise<void> > result;       // for detached task
+};
+} // namespace xx
+
+template<typename T>
+class Task {
+  public:
+    typedef xx::TaskPromise<T> promise_type;
+    typedef std::coroutine_handle<promise_type> handle;
+
+    explicit Task(handle h = handle())
+        : _h(h) {
+    }
+
+    Task(Task&& o) noexcept
+        : _h(o._h) {
+        o._h = handle();
+    }
+
+    Task& operator=(Task&& o) noexcept {
+        if (this != &o) {
+            if (_h) _h.destroy();
+            _h = o._h;
+            o._h = handle();
+        }
+        return *this;
+    }
+
+    ~Task() {
+        if (_h) _h.destroy();
+    }
+
+    /*
+     * run the task on the executor, or in the calling thread if e is NULL.
+     * the task frees itself when it is done.
+     */
+    Future<T> Start(Executor* e) {
+        CHECK(_h);
+        handle h = _h;
+        _h = handle();
+
+        promise_type& p = h.promise();
+        p.executor = e;
+        p.detached = true;
+        p.result.reset(new Promise<T>());
+        Future<T> f = p.result->GetFuture();
+
+        xx::Resume(e, h);
+        return f;
+    }
+
+    struct Awaiter {
+        handle h;
+
+        bool await_ready() noexcept {
+            return false;
+        }
+
+        // start the child task, it inherits the executor of the caller
+        template<typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> caller) noexcept {
+            h.promise().continuation = caller;
+            h.promise().executor = xx::ExecutorOf(caller);
+            return h;
+        }
+
+        T await_resume() {
+            if constexpr (!std::is_void<T>::value) {
+                return std::move(*h.promise().value);
+            }
+        }
+    };
+
+    Awaiter operator co_await() && {
+        return Awaiter { _h };
+    }
+
+    Awaiter operator co_await() & {
+        return Awaiter { _h };
+    }
+
+  private:
+    handle _h;
+
+    Task(const Task&) = delete;
+    void operator=(const Task&) = delete;
+};
+
+namespace xx {
+template<typename T>
+inline Task<T> TaskPromise<T>::get_return_object() noexcept {
+    return Task<T>(std::coroutine_handle<TaskPromise<T> >::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept {
+    return Task<void>(std::coroutine_handle<TaskPromise<void> >::from_promise(*this));
+}
+} // namespace xx
+
+/*
+ * co_await SwitchTo(&pool): continue the task on another executor
+ */
+class SwitchTo {
+  public:
+    explicit SwitchTo(Executor* e)
+        : _e(e) {
+    }
+
+    bool await_ready() noexcept {
+        return false;
+    }
+
+    template<typename P>
+    void await_suspend(std::coroutine_handle<P> h) {
+        if constexpr (std::is_base_of<xx::TaskPromiseBase, P>::value) {
+            h.promise().executor = _e;
+        }
+        xx::Resume(_e, h);
+    }
+
+    void await_resume() noexcept {
+    }
+
+  private:
+    Executor* _e;
+};
+
+/*
+ * CoEvent: awaitable SyncEvent. co_await returns at once if signaled.
+ *   With manual_reset == false, Notify() wakes up one waiter, or leaves the
+ *   event signaled for the next one if nobody is waiting.
+ */
+class CoEvent {
+  public:
+    explicit CoEvent(bool manual_reset = true, bool signaled = false)
+        : _manual_reset(manual_reset), _signaled(signaled) {
+    }
+
+    ~CoEvent() {
+    }
+
+    void Notify() {
+        std::vector<xx::Waiter> v;
+        {
+            ScopedMutex m(_mutex);
+            if (_manual_reset) {
+                _signaled = true;
+                _waiters.swap(v);
+            } else if (!_waiters.empty()) {
+                v.push_back(_waiters.front());
+                _waiters.erase(_waiters.begin());
+            } else {
+                _signaled = true;
+            }
+        }
+
+        for (::size_t i = 0; i < v.size(); ++i) {
+            xx::Resume(v[i].e, v[i].h);
+        }
+    }
+
+    void Reset() {
+        ScopedMutex m(_mutex);
+        _signaled = false;
+    }
+
+    bool Signaled() {
+        ScopedMutex m(_mutex);
+        return _signaled;
+    }
+
+    struct Awaiter {
+        CoEvent* ev;
+
+        bool await_ready() noexcept {
+            return false;
+        }
+
+        // return false to go on without suspending
+        template<typename P>
+        bool await_suspend(std::coroutine_handle<P> h) {
+            ScopedMutex m(ev->_mutex);
+            if (ev->_signaled) {
+                if (!ev->_manual_reset) ev->_signaled = false;
+                return false;
+            }
+
+            xx::Waiter w = { h, xx::ExecutorOf(h) };
+            ev->_waiters.push_back(w);
+            return true;
+        }
+
+        void await_resume() noexcept {
+        }
+    };
+
+    Awaiter operator co_await() {
+        return Awaiter { this };
+    }
+
+  private:
+    Mutex _mutex;
+    const bool _manual_reset;
+    bool _signaled;
+    std::vector<xx::Waiter> _waiters;
+
+    DISALLOW_COPY_AND_ASSIGN(CoEvent);
+};
+
+/*
+ * CoMutex: awaitable Mutex, waiters get the lock in FIFO order.
+ *
+ *   co_await m.Lock();
+ *   m.UnLock();          // the lock is handed to the next waiter
+ */
+class CoMutex {
+  public:
+    CoMutex()
+        : _locked(false) {
+    }
+
+    ~CoMutex() {
+    }
+
+    bool TryLock() {
+        ScopedMutex m(_mutex);
+        if (_locked) return false;
+        _locked = true;
+        return true;
+    }
+
+    void UnLock() {
+        xx::Waiter w;
+        {
+            ScopedMutex m(_mutex);
+            DCHECK(_locked);
+            if (_waiters.empty()) {
+                _locked = false;
+                return;
+            }
+
+            w = _waiters.front();
+            _waiters.pop_front();
+        }
+
+        xx::Resume(w.e, w.h);
+    }
+
+    struct Awaiter {
+        CoMutex* m;
+
+        bool await_ready() noexcept {
+            return false;
+        }
+
+        template<typename P>
+        bool await_suspend(std::coroutine_handle<P> h) {
+            ScopedMutex l(m->_mutex);
+            if (!m->_locked) {
+                m->_locked = true;
+                return false;
+            }
+
+            xx::Waiter w = { h, xx::ExecutorOf(h) };
+            m->_waiters.push_back(w);
+            return true;
+        }
+
+        void await_resume() noexcept {
+        }
+    };
+
+    Awaiter Lock() {
+        return Awaiter { this };
+    }
+
+  private:
+    Mutex _mutex;
+    bool _locked;
+    std::deque<xx::Waiter> _waiters;
+
+    DISALLOW_COPY_AND_ASSIGN(CoMutex);
+};
+
+/*
+ * co_await CoSleep(&tw, ms): resume the task after ms, the timer wheel
+ * must be started.
+ */
+class CoSleep {
+  public:
+    CoSleep(TimerWheel* tw, uint32 ms)
+        : _tw(tw), _ms(ms) {
+    }
+
+    bool await_ready() noexcept {
+        return _ms == 0;
+    }
+
+    template<typename P>
+    void await_suspend(std::coroutine_handle<P> h) {
+        _tw->RunAfter(_ms, NewCallback(&CoSleep::Wake, xx::ExecutorOf(h),
+                                       static_cast<void*>(h.address())));
+    }
+
+    void await_resume() noexcept {
+    }
+
+  private:
+    TimerWheel* _tw;
+    uint32 _ms;
+
+    static void Wake(Executor* e, void* h) {
+        xx::Resume(e, std::coroutine_handle<>::from_address(h));
+    }
+};
+
+#endif // C++20
@@ -0,0 +1,175 @@
+#include "thread_local.h"
+#include "thread_util.h"
+
+#include <set>
+#include <utility>
+
+namespace xx {
+#ifndef _WIN32
+__thread void** tls_slots = NULL;
+__thread uint32 tls_size = 0;
+#else
+__declspec(thread) void** tls_slots = NULL;
+__declspec(thread) uint32 tls_size = 0;
+#endif
+
+#ifndef _WIN32
+static __thread bool xSlotsGone = false;   // slots of the thread destroyed
+#else
+static __declspec(thread) bool xSlotsGone = false;
+#endif
+
+// rounds of deleting instances at thread exit, as PTHREAD_DESTRUCTOR_ITERATIONS
+static const uint32 MAX_DESTROY_ROUNDS = 4;
+
+/*
+ * slots of one thread, deleted with their instances when the thread exits.
+ */
+class ThreadSlots {
+  public:
+    ThreadSlots();
+    ~ThreadSlots();
+
+    // make room for slot id, and point tls_slots to the slots
+    void Reserve(uint32 id);
+
+    std::vector<void*> v;
+};
+
+struct Registry {
+    Mutex mutex;
+    std::vector<ThreadLocalBase*> locals;     // by id, NULL if free
+    std::set<ThreadSlots*> threads;
+};
+
+// never deleted, threads may exit after static objects are destroyed
+static Registry* GetRegistry() {
+    static Registry* kRegistry = new Registry;
+    return kRegistry;
+}
+
+// the thread_local object is destroyed when the thread exits
+static ThreadSlots* GetThreadSlots() {
+    static thread_local ThreadSlots kSlots;
+    return &kSlots;
+}
+
+ThreadSlots::ThreadSlots() {
+    Registry* r = GetRegistry();
+    ScopedMutex m(r->mutex);
+    r->threads.insert(this);
+}
+
+/*
+ * instances are deleted out of the lock, and their destructors may use
+ * ThreadLocals of this thread again. Instances created by them go to the
+ * slots, still alive here, and are deleted in the next round. In the last
+ * round the slots are released first, and Create() fails from then on.
+ */
+ThreadSlots::~ThreadSlots() {
+    Registry* r = GetRegistry();
+
+    for (uint32 round = 1; ; ++round) {
+        std::vector<std::pair<void (*)(void*), void*> > x;
+        bool last;
+        {
+            ScopedMutex m(r->mutex);
+            for (uint32 i = 0; i < v.size(); ++i) {
+                if (v[i] != NULL) {
+                    x.push_back(std::make_pair(r->locals[i]->_destroy, v[i]));
+                    v[i] = NULL;
+                }
+            }
+
+            last = x.empty() || round == MAX_DESTROY_ROUNDS;
+            if (last) {
+                r->threads.erase(this);
+                tls_slots = NULL;
+                tls_size = 0;
+                xSlotsGone = true;
+            }
+        }
+
+        for (::size_t i = 0; i < x.size(); ++i) {
+            x[i].first(x[i].second);
+        }
+
+        if (last) break;
+    }
+}
+
+void ThreadSlots::Reserve(uint32 id) {
+    if (id >= v.size()) v.resize(id + 1, NULL);
+    tls_slots = &v[0];
+    tls_size = static_cast<uint32>(v.size());
+}
+
+static uint32 NewId(ThreadLocalBase* t) {
+    Registry* r = GetRegistry();
+    ScopedMutex m(r->mutex);
+
+    for (uint32 i = 0; i < r->locals.size(); ++i) {
+        if (r->locals[i] == NULL) {
+            r->locals[i] = t;
+            return i;
+        }
+    }
+
+    r->locals.push_back(t);
+    return static_cast<uint32>(r->locals.size() - 1);
+}
+
+ThreadLocalBase::ThreadLocalBase(void* (*create)(), void (*destroy)(void*))
+    : _id(NewId(this)), _create(create), _destroy(destroy) {
+}
+
+// clear the slot in all threads, so the id can be used again
+ThreadLocalBase::~ThreadLocalBase() {
+    std::vector<void*> x;
+    {
+        Registry* r = GetRegistry();
+        ScopedMutex m(r->mutex);
+
+        std::set<ThreadSlots*>::iterator it = r->threads.begin();
+        for (; it != r->threads.end(); ++it) {
+            std::vector<void*>& v = (*it)->v;
+            if (_id < v.size() && v[_id] != NULL) {
+                x.push_back(v[_id]);
+                v[_id] = NULL;
+            }
+        }
+
+        r->locals[_id] = NULL;
+    }
+
+    for (::size_t i = 0; i < x.size(); ++i) {
+        _destroy(x[i]);
+    }
+}
+
+void* ThreadLocalBase::Create() {
+    // used by destructors of thread_local objects after the slots are gone,
+    // or by instance destructors creating instances again and again
+    CHECK(!xSlotsGone);
+
+    ThreadSlots* s = GetThreadSlots();
+    void* p = _create();
+
+    Registry* r = GetRegistry();
+    ScopedMutex m(r->mutex);
+    s->Reserve(_id);
+    s->v[_id] = p;
+    return p;
+}
+
+void ThreadLocalBase::ForEach(void (*f)(void*, void*), void* arg) {
+    Registry* r = GetRegistry();
+    ScopedMutex m(r->mutex);
+
+    std::set<ThreadSlots*>::iterator it = r->threads.begin();
+    for (; it != r->threads.end(); ++it) {
+        std::vector<void*>& v = (*it)->v;
+        if (_id < v.size() && v[_id] != NULL) f(v[_id], arg);
+    }
+}
+} // namespace xx
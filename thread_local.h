@@ -0,0 +1,119 @@
+#pragma once
+
+#include "data_types.h"
+
+#include <stddef.h>
+#include <vector>
+
+/*
+ * ThreadLocal<T>: one instance of T for each thread, created on first use,
+ * and deleted when the thread exits (Thread, AutoThread, or any other) or
+ * when the ThreadLocal is destroyed.
+ *
+ *   Unlike a thread_local variable, a ThreadLocal can be a class member, and
+ *   one thread can visit the instances of all threads. get() is a TLS load
+ *   and an array index once the instance of the thread exists.
+ *
+ *   ThreadLocal<Stats> stats;
+ *   stats->requests++;                       // instance of the calling thread
+ *
+ *   stats.ForEach([](Stats* s) { ... });     // instances of all threads
+ *   uint64 n = stats.Collect((uint64) 0,
+ *       [](uint64 sum, const Stats& s) { return sum + s.requests; });
+ *
+ *   ForEach() and Collect() hold a global lock, which blocks threads creating
+ *   or deleting instances, but not those using them. Fields read there while
+ *   other threads change them need atomic access.
+ *
+ *   Destructors of instances may use other ThreadLocals when their thread
+ *   exits. Instances created then are deleted in up to 4 rounds, and a use
+ *   after that is a fatal error.
+ */
+namespace xx {
+#ifndef _WIN32
+extern __thread void** tls_slots;     // slots of the calling thread
+extern __thread uint32 tls_size;
+#else
+extern __declspec(thread) void** tls_slots;
+extern __declspec(thread) uint32 tls_size;
+#endif
+
+class ThreadLocalBase {
+  protected:
+    explicit ThreadLocalBase(void* (*create)(), void (*destroy)(void*));
+
+    // delete instances of all threads
+    ~ThreadLocalBase();
+
+    // create the instance of the calling thread
+    void* Create();
+
+    // f(instance, arg) for instances of all threads, with the lock held
+    void ForEach(void (*f)(void*, void*), void* arg);
+
+    const uint32 _id;        // index in the slots of threads
+
+  private:
+    void* (*_create)();
+    void (*_destroy)(void*);
+
+    friend class ThreadSlots;
+
+    DISALLOW_COPY_AND_ASSIGN(ThreadLocalBase);
+};
+} // namespace xx
+
+template<typename T>
+class ThreadLocal : public xx::ThreadLocalBase {
+  public:
+    ThreadLocal()
+        : xx::ThreadLocalBase(&ThreadLocal::New, &ThreadLocal::Delete) {
+    }
+
+    ~ThreadLocal() {
+    }
+
+    T* get() {
+        if (_id < xx::tls_size && xx::tls_slots[_id] != NULL) {
+            return static_cast<T*>(xx::tls_slots[_id]);
+        }
+        return static_cast<T*>(this->Create());
+    }
+
+    T* operator->() {
+        return this->get();
+    }
+
+    T& operator*() {
+        return *this->get();
+    }
+
+    // f(T*) for instances of all threads
+    template<typename F>
+    void ForEach(F f) {
+        xx::ThreadLocalBase::ForEach(&ThreadLocal::Call<F>, &f);
+    }
+
+    // fold instances of all threads: r = f(r, t)
+    template<typename R, typename F>
+    R Collect(R init, F f) {
+        this->ForEach([&](T* t) { init = f(init, *t); });
+        return init;
+    }
+
+  private:
+    static void* New() {
+        return new T();
+    }
+
+    static void Delete(void* p) {
+        delete static_cast<T*>(p);
+    }
+
+    template<typename F>
+    static void Call(void* p, void* f) {
+        (*static_cast<F*>(f))(static_cast<T*>(p));
+    }
+
+    DISALLOW_COPY_AND_ASSIGN(ThreadLocal);
+};
@@ -0,0 +1,308 @@
+#include "thread_pool.h"
+#include "cpu_topology.h"
+
+static thread_local void* xWorker = NULL;      // worker of the current thread
+static thread_local uint32 xSeed = 0;          // for threads out of the pool
+
+// xorshift, good enough to pick a victim
+static inline uint32 NextRandom(uint32* seed) {
+    uint32 x = *seed;
+    if (x == 0) x = static_cast<uint32>(reinterpret_cast<uintptr_t>(seed)) | 1;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *seed = x;
+}
+
+namespace xx {
+WorkDeque::WorkDeque()
+    : _top(0), _bottom(0), _ring(NewRing(256)) {
+}
+
+WorkDeque::~WorkDeque() {
+    _old.push_back(_ring);
+    for (::size_t i = 0; i < _old.size(); ++i) {
+        delete[] _old[i]->slots;
+        delete _old[i];
+    }
+}
+
+WorkDeque::Ring* WorkDeque::NewRing(int64 size) {
+    Ring* r = new Ring;
+    r->mask = size - 1;
+    r->slots = new Closure*[size];
+    return r;
+}
+
+WorkDeque::Ring* WorkDeque::Grow(Ring* r, int64 t, int64 b) {
+    Ring* x = NewRing((r->mask + 1) * 2);
+    for (int64 i = t; i < b; ++i) {
+        Closure* c = __atomic_load_n(&r->slots[i & r->mask], __ATOMIC_RELAXED);
+        __atomic_store_n(&x->slots[i & x->mask], c, __ATOMIC_RELAXED);
+    }
+
+    _old.push_back(r);
+    __atomic_store_n(&_ring, x, __ATOMIC_RELEASE);
+    return x;
+}
+
+void WorkDeque::Push(Closure* c) {
+    int64 b = __atomic_load_n(&_bottom, __ATOMIC_RELAXED);
+    int64 t = __atomic_load_n(&_top, __ATOMIC_ACQUIRE);
+    Ring* r = __atomic_load_n(&_ring, __ATOMIC_RELAXED);
+    if (b - t > r->mask) r = this->Grow(r, t, b);
+
+    __atomic_store_n(&r->slots[b & r->mask], c, __ATOMIC_RELAXED);
+    __atomic_store_n(&_bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * take the bottom slot first, then look at the top: the fence makes sure a
+ * thief either sees the new bottom, or we see its new top. Only the last
+ * closure needs a CAS against thieves.
+ */
+Closure* WorkDeque::Pop() {
+    int64 b = __atomic_load_n(&_bottom, __ATOMIC_RELAXED) - 1;
+    Ring* r = __atomic_load_n(&_ring, __ATOMIC_RELAXED);
+    __atomic_store_n(&_bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64 t = __atomic_load_n(&_top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        __atomic_store_n(&_bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    Closure* c = __atomic_load_n(&r->slots[b & r->mask], __ATOMIC_RELAXED);
+    if (t == b) {
+        if (!__atomic_compare_exchange_n(&_top, &t, t + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            c = NULL;
+        }
+        __atomic_store_n(&_bottom, b + 1, __ATOMIC_RELAXED);
+    }
+
+    return c;
+}
+
+Closure* WorkDeque::Steal() {
+    int64 t = __atomic_load_n(&_top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64 b = __atomic_load_n(&_bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) return NULL;
+
+    Ring* r = __atomic_load_n(&_ring, __ATOMIC_ACQUIRE);
+    Closure* c = __atomic_load_n(&r->slots[t & r->mask], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&_top, &t, t + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    return c;
+}
+} // namespace xx
+
+ThreadPool::ThreadPool(uint32 nthreads)
+    : _started(false) {
+    if (nthreads == 0) nthreads = CpuTopology::AvailableCpuNum();
+
+    _workers.resize(nthreads);
+    for (uint32 i = 0; i < nthreads; ++i) {
+        Worker* w = new Worker;
+        w->pool = this;
+        w->seed = i + 1;
+        w->t.reset(new Thread(this, &ThreadPool::Loop, w));
+        _workers[i] = w;
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    this->Stop();
+    for (::size_t i = 0; i < _workers.size(); ++i) {
+        delete _workers[i];
+    }
+}
+
+bool ThreadPool::Start() {
+    if (_started) return true;
+    _started = true;
+
+    for (::size_t i = 0; i < _workers.size(); ++i) {
+        if (!_workers[i]->t->Start()) {
+            this->Stop();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void ThreadPool::Stop() {
+    if (!_stop.CompareSwap(0, 1)) return;
+
+    for (::size_t i = 0; i < _workers.size(); ++i) {
+        Worker* w = _workers[i];
+        if (w->idle.CompareSwap(1, 0)) _nidle.Dec();
+        w->ev.Notify();
+    }
+
+    for (::size_t i = 0; i < _workers.size(); ++i) {
+        _workers[i]->t->Join();
+    }
+}
+
+bool ThreadPool::InWorker() const {
+    Worker* w = static_cast<Worker*>(xWorker);
+    return w != NULL && w->pool == this;
+}
+
+uint32 ThreadPool::pending() const {
+    uint32 n = 0;
+    for (::size_t i = 0; i < _workers.size(); ++i) {
+        Worker* w = _workers[i];
+        n += w->tasks.size() + __atomic_load_n(&w->ninbox, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+void ThreadPool::Post(Closure* c) {
+    Worker* w = static_cast<Worker*>(xWorker);
+    if (w != NULL && w->pool == this) {
+        w->tasks.Push(c);
+    } else {
+        w = _workers[NextRandom(&xSeed) % _workers.size()];
+        ScopedMutex m(w->mutex);
+        w->inbox.push_back(c);
+        __atomic_store_n(&w->ninbox, static_cast<uint32>(w->inbox.size()),
+                         __ATOMIC_RELAXED);
+    }
+
+    // pairs with Park(): either the worker sees the closure, or we see it
+    // idle. _nidle is written only when workers park or wake up.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (_nidle.value() != 0) this->WakeOne();
+}
+
+void ThreadPool::WakeOne() {
+    uint32 n = this->size();
+    uint32 k = NextRandom(&xSeed);
+
+    for (uint32 i = 0; i < n; ++i) {
+        Worker* w = _workers[(k + i) % n];
+        if (w->idle.CompareSwap(1, 0)) {
+            _nidle.Dec();
+            w->ev.Notify();
+            return;
+        }
+    }
+}
+
+bool ThreadPool::RunOne() {
+    Worker* w = static_cast<Worker*>(xWorker);
+    Closure* c = this->Next(w != NULL && w->pool == this ? w : NULL);
+    if (c == NULL) return false;
+
+    c->Run();
+    return true;
+}
+
+// w is NULL for threads out of the pool, they can only steal
+Closure* ThreadPool::Next(Worker* w) {
+    Closure* c = NULL;
+
+    if (w != NULL) {
+        c = w->tasks.Pop();
+        if (c == NULL && __atomic_load_n(&w->ninbox, __ATOMIC_RELAXED) != 0) {
+            c = this->TakeInbox(w);
+        }
+    }
+
+    // steal from the top of others, starting from a random victim
+    uint32 n = this->size();
+    uint32 k = NextRandom(w != NULL ? &w->seed : &xSeed);
+    for (uint32 i = 0; c == NULL && i < n; ++i) {
+        Worker* v = _workers[(k + i) % n];
+        if (v == w) continue;
+
+        c = v->tasks.Steal();
+        if (c == NULL && __atomic_load_n(&v->ninbox, __ATOMIC_RELAXED) != 0) {
+            c = this->StealInbox(v);
+        }
+    }
+
+    return c;
+}
+
+// move the inbox of the worker to its deque, return the oldest closure
+Closure* ThreadPool::TakeInbox(Worker* w) {
+    std::deque<Closure*> v;
+    {
+        ScopedMutex m(w->mutex);
+        v.swap(w->inbox);
+        __atomic_store_n(&w->ninbox, 0, __ATOMIC_RELAXED);
+    }
+
+    if (v.empty()) return NULL;
+
+    // pushed in reverse order, so they are popped in the order of posting
+    for (::size_t i = v.size() - 1; i > 0; --i) {
+        w->tasks.Push(v[i]);
+    }
+    return v[0];
+}
+
+Closure* ThreadPool::StealInbox(Worker* v) {
+    ScopedMutex m(v->mutex);
+    if (v->inbox.empty()) return NULL;
+
+    Closure* c = v->inbox.front();
+    v->inbox.pop_front();
+    __atomic_store_n(&v->ninbox, static_cast<uint32>(v->inbox.size()),
+                     __ATOMIC_RELAXED);
+    return c;
+}
+
+bool ThreadPool::HasWork() const {
+    for (::size_t i = 0; i < _workers.size(); ++i) {
+        Worker* w = _workers[i];
+        if (w->tasks.size() != 0) return true;
+        if (__atomic_load_n(&w->ninbox, __ATOMIC_RELAXED) != 0) return true;
+    }
+    return false;
+}
+
+/*
+ * sleep until WakeOne() or Stop() picks this worker, unless there is work
+ * again or the pool is stopping.
+ */
+void ThreadPool::Park(Worker* w) {
+    w->idle.Or(1);
+    _nidle.Inc();  // full barrier, pairs with the fence in Post()
+
+    if (this->HasWork() || _stop.value() != 0) {
+        if (w->idle.CompareSwap(1, 0)) {
+            _nidle.Dec();
+            return;
+        }
+        // someone is waking us up, the event is (or will be) signaled
+    }
+
+    w->ev.Wait();
+}
+
+void ThreadPool::Loop(Worker* w) {
+    xWorker = w;
+
+    while (true) {
+        Closure* c = this->Next(w);
+        if (c != NULL) {
+            c->Run();
+            continue;
+        }
+
+        if (_stop.value() != 0) break;
+        this->Park(w);
+    }
+
+    xWorker = NULL;
+}
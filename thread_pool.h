@@ -0,0 +1,143 @@
+#pragma once
+
+#include "data_types.h"
+#include "atomic.h"
+#include "executor.h"
+#include "thread_util.h"
+
+#include <deque>
+#include <vector>
+
+namespace xx {
+/*
+ * Chase-Lev work stealing deque. The owner pushes and pops at the bottom,
+ * other threads steal from the top. The ring doubles when it is full, and old
+ * rings are kept until the deque is deleted, as a thief may still read them.
+ */
+class WorkDeque {
+  public:
+    WorkDeque();
+    ~WorkDeque();
+
+    // owner only
+    void Push(Closure* c);
+
+    // owner only, NULL if empty
+    Closure* Pop();
+
+    // NULL if empty, or another thread took the closure first
+    Closure* Steal();
+
+    // approximate when other threads are working on the deque
+    uint32 size() const {
+        int64 b = __atomic_load_n(&_bottom, __ATOMIC_RELAXED);
+        int64 t = __atomic_load_n(&_top, __ATOMIC_RELAXED);
+        return b > t ? static_cast<uint32>(b - t) : 0;
+    }
+
+  private:
+    struct Ring {
+        int64 mask;
+        Closure** slots;
+    };
+
+    char _pad0[CACHE_LINE_SIZE];
+    int64 _top;                      // next closure to steal
+    char _pad1[CACHE_LINE_SIZE - sizeof(int64)];
+    int64 _bottom;                   // next slot to push, owner only
+    Ring* _ring;
+    std::vector<Ring*> _old;
+    char _pad2[CACHE_LINE_SIZE];
+
+    static Ring* NewRing(int64 size);
+    Ring* Grow(Ring* r, int64 t, int64 b);
+
+    DISALLOW_COPY_AND_ASSIGN(WorkDeque);
+};
+} // namespace xx
+
+/*
+ * ThreadPool: a fixed number of worker threads sharing closures.
+ *
+ *   Every worker owns a lock-free Chase-Lev deque. A closure posted from a
+ *   worker goes to the bottom of that worker's deque, and the worker pops from
+ *   the bottom (LIFO, cache friendly), with no lock and no shared counter.
+ *   Closures posted from other threads go to the inbox of a random worker.
+ *   A worker with nothing to do steals from the top of the other deques and
+ *   inboxes, and sleeps only when there is nothing to steal.
+ *
+ *   The pool does not delete closures, see executor.h.
+ *
+ *   ThreadPool pool;     // one worker per cpu
+ *   pool.Start();
+ *   pool.Post(NewCallback(&fun, 7));
+ *   pool.Post(&obj, &T::world, 7);
+ *   pool.Stop();         // run the queued closures and join the workers
+ */
+class ThreadPool : public Executor {
+  public:
+    // nthreads == 0: one worker for each online cpu
+    explicit ThreadPool(uint32 nthreads = 0);
+
+    // call Stop()
+    virtual ~ThreadPool();
+
+    // return false if any worker failed to start
+    bool Start();
+
+    // wait for all queued closures to finish, and join the workers.
+    // closures must not be posted from outside the pool after Stop().
+    void Stop();
+
+    using Executor::Post;
+    virtual void Post(Closure* c);
+
+    /*
+     * run one pending closure in the calling thread, return false if there
+     * is none. A thread waiting for closures it posted can help with this
+     * instead of blocking, which also makes nested parallelism safe.
+     */
+    bool RunOne();
+
+    uint32 size() const {
+        return static_cast<uint32>(_workers.size());
+    }
+
+    // number of closures waiting to run, approximate
+    uint32 pending() const;
+
+    // return true if the calling thread is one of the workers
+    bool InWorker() const;
+
+  private:
+    struct Worker {
+        Worker()
+            : pool(NULL), ninbox(0), ev(false, false), seed(0) {
+        }
+
+        ThreadPool* pool;
+        xx::WorkDeque tasks;         // posted from the worker itself
+        Mutex mutex;
+        std::deque<Closure*> inbox;  // posted from out of the pool
+        uint32 ninbox;               // size of inbox, read without the lock
+        scoped_ptr<Thread> t;
+        SyncEvent ev;
+        atomic_t idle;
+        uint32 seed;
+    };
+
+    std::vector<Worker*> _workers;
+    atomic_t _nidle;
+    atomic_t _stop;
+    bool _started;
+
+    void Loop(Worker* w);
+    Closure* Next(Worker* w);
+    Closure* TakeInbox(Worker* w);
+    Closure* StealInbox(Worker* v);
+    bool HasWork() const;
+    void Park(Worker* w);
+    void WakeOne();
+
+    DISALLOW_COPY_AND_ASSIGN(ThreadPool);
+};
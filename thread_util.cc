@@ -1,11 +1,73 @@
 #ifndef _WIN32
 
 #include "thread_util.h"
+#include "cpu_topology.h"
+#include "spin_lock.h"
+#include "time_util.h"
+
+#include <limits.h>
+#include <sched.h>
 
 #ifdef __APPLE__
 #  include <sys/time.h> // for gettimeofday()
 #endif
 
+#ifdef __linux__
+#  include <sys/syscall.h>
+#  include <linux/mempolicy.h>
+#endif
+
+#if defined(__linux__) && defined(USE_FUTEX)
+void Mutex::LockSlow() {
+    for (int i = 0; i < 100; ++i) {
+        uint32 s = __atomic_load_n(&_state, __ATOMIC_RELAXED);
+        if (s == 0 && this->RawTryLock()) return;
+        if (s == 2) break;  // others are sleeping already
+        xx::CpuRelax();
+    }
+    this->LockContended();
+}
+
+bool SyncEvent::TimedWait(uint32 ms) {
+    if (this->Consume()) return true;
+
+    uint64 deadline = NowInUs() + ms * 1000ULL;
+    __atomic_add_fetch(&_waiters, 1, __ATOMIC_SEQ_CST);
+
+    bool ok;
+    while (!(ok = this->Consume())) {
+        uint64 now = NowInUs();
+        if (now >= deadline) break;
+        xx::FutexWait(&_signaled, 0, deadline - now);
+    }
+
+    __atomic_sub_fetch(&_waiters, 1, __ATOMIC_RELAXED);
+    return ok;
+}
+
+void Condition::NotifyAll() {
+    uint32 seq = __atomic_add_fetch(&_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&_waiters, __ATOMIC_SEQ_CST) == 0) return;
+
+    Mutex* m = __atomic_load_n(&_mutex, __ATOMIC_RELAXED);
+    while (!xx::FutexRequeue(&_seq, seq, 1, &m->_state)) {
+        if (errno != EAGAIN) {
+            xx::FutexWake(&_seq, 0x7fffffff);
+            return;
+        }
+        seq = __atomic_load_n(&_seq, __ATOMIC_SEQ_CST);  // notified again
+    }
+}
+
+bool Condition::TimedWait(Mutex& mutex, uint32 ms) {
+    ScopedTryLock m(mutex);
+    uint32 seq = this->Prepare(mutex);
+    bool ok = ms > 0 && xx::FutexWait(&_seq, seq, ms * 1000ULL);
+    this->Finish(mutex);
+    return ok;
+}
+
+#else
 static inline void CondInit(pthread_cond_t* cond) {
 #ifdef __APPLE__
     CHECK(pthread_cond_init(cond, NULL) == 0);
@@ -72,5 +134,80 @@ bool Condition::TimedWait(Mutex& mutex, uint32 ms) {
     CHECK_EQ(ret, 0);
     return true;
 }
+#endif
+
+bool Thread::Start(const ThreadOptions& options) {
+    CHECK(_c != NULL);
+
+    pthread_attr_t attr;
+    CHECK(pthread_attr_init(&attr) == 0);
+
+    if (options.stack_size > 0) {
+        ::size_t size = options.stack_size;
+        if (size < (::size_t) PTHREAD_STACK_MIN) size = PTHREAD_STACK_MIN;
+        CHECK(pthread_attr_setstacksize(&attr, size) == 0);
+    }
+
+    if (options.sched_policy >= 0) {
+        struct sched_param param;
+        ::memset(&param, 0, sizeof(param));
+        param.sched_priority = options.sched_priority;
+
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        if (pthread_attr_setschedpolicy(&attr, options.sched_policy) != 0 ||
+            pthread_attr_setschedparam(&attr, &param) != 0) {
+            pthread_attr_destroy(&attr);
+            return false;
+        }
+    }
+
+#ifdef __linux__
+    std::vector<int> cpus = options.cpus;
+    if (cpus.empty() && options.numa_node >= 0) {
+        cpus = NumaNodeCpus(options.numa_node);
+    }
+
+    if (!cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (::size_t i = 0; i < cpus.size(); ++i) {
+            if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE) CPU_SET(cpus[i], &set);
+        }
+        if (pthread_attr_setaffinity_np(&attr, sizeof(set), &set) != 0) {
+            pthread_attr_destroy(&attr);
+            return false;
+        }
+    }
+#endif
+
+    if (!options.name.empty() || options.numa_node >= 0) {
+        _opt.reset(new ThreadOptions(options));
+    }
+
+    int err = pthread_create(&_id, &attr, &Thread::Run, (void*) this);
+    pthread_attr_destroy(&attr);
+    return err == 0;
+}
+
+void Thread::Init(const ThreadOptions& opt) {
+    if (!opt.name.empty()) {
+#if defined(__linux__)
+        std::string name = opt.name.substr(0, 15);
+        pthread_setname_np(pthread_self(), name.c_str());
+#elif defined(__APPLE__)
+        pthread_setname_np(opt.name.c_str());
+#endif
+    }
+
+#ifdef __linux__
+    // prefer memory of the node, fall back to others when it is full
+    if (opt.numa_node >= 0 && opt.numa_node < 1024) {
+        unsigned long mask[1024 / (8 * sizeof(unsigned long))] = { 0 };
+        const int bits = 8 * sizeof(unsigned long);
+        mask[opt.numa_node / bits] |= 1UL << (opt.numa_node % bits);
+        ::syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, 1024);
+    }
+#endif
+}
 
 #endif // _WIN32
@@ -2,9 +2,15 @@
 
 #include <cclog/cclog.h>
 #include "data_types.h"
+#include "atomic.h"
 #include "closure.h"
+#include "futex.h"
+#include "lock_profiler.h"
 #include "scoped_ptr.h"
 
+#include <string>
+#include <vector>
+
 #ifndef _WIN32
 #  include <string.h>
 #  include <unistd.h>
@@ -17,29 +23,102 @@
 #  include <windows.h>
 #endif
 
+/*
+ * Build with -DUSE_FUTEX to have Mutex, SyncEvent and Condition on linux built
+ * on futex instead of pthread. Locking a free Mutex, or notifying an event or
+ * condition nobody waits for, is then one atomic operation without syscall.
+ * Mutex::mutex() is not available in this mode.
+ */
+
 /******************************=> Mutex & RwLock ******************************/
 #ifndef _WIN32 // unix
+#if defined(__linux__) && defined(USE_FUTEX)
+class Condition;
+
+class Mutex {
+  public:
+    Mutex()
+        : _state(0) {
+    }
+    ~Mutex() {
+        LOCK_PROFILE_DESTROY();
+        CHECK_EQ(_state, 0);
+    }
+
+    void Lock() {
+        LOCK_PROFILE_LOCK(xx::LOCK_MUTEX, this->RawTryLock(), this->RawLock());
+    }
+
+    void UnLock() {
+        LOCK_PROFILE_UNLOCK();
+        if (__atomic_exchange_n(&_state, 0, __ATOMIC_RELEASE) == 2) {
+            xx::FutexWake(&_state, 1);
+        }
+    }
+
+    bool TryLock() {
+        return LOCK_PROFILE_TRY(xx::LOCK_MUTEX, this->RawTryLock());
+    }
+
+  private:
+    uint32 _state;     // 0: free, 1: locked, 2: locked, maybe with sleepers
+
+    bool RawTryLock() {
+        uint32 v = 0;
+        return __atomic_compare_exchange_n(&_state, &v, 1, false,
+                                           __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    }
+
+    void RawLock() {
+        if (!this->RawTryLock()) this->LockSlow();
+    }
+
+    // spin a little, then sleep
+    void LockSlow();
+
+    // lock as if there are sleepers
+    void LockContended() {
+        while (__atomic_exchange_n(&_state, 2, __ATOMIC_ACQUIRE) != 0) {
+            xx::FutexWait(&_state, 2);
+        }
+    }
+
+    // lock again after waiting on a Condition, threads requeued by
+    // NotifyAll() may sleep on the mutex. profiled as Lock().
+    void Relock() {
+        LOCK_PROFILE_LOCK(xx::LOCK_MUTEX,
+                          __atomic_exchange_n(&_state, 2, __ATOMIC_ACQUIRE) == 0,
+                          this->LockContended());
+    }
+
+    friend class Condition;
+
+    DISALLOW_COPY_AND_ASSIGN(Mutex);
+};
+
+#else
 class Mutex {
   public:
     Mutex() {
         CHECK(pthread_mutex_init(&_mutex, NULL) == 0);
     }
     ~Mutex() {
+        LOCK_PROFILE_DESTROY();
         CHECK(pthread_mutex_destroy(&_mutex) == 0);
     }
 
     void Lock() {
-        int err = pthread_mutex_lock(&_mutex);
-        CHECK_EQ(err, 0)<< ::strerror(err);
+        LOCK_PROFILE_LOCK(xx::LOCK_MUTEX, this->RawTryLock(), this->RawLock());
     }
 
     void UnLock() {
+        LOCK_PROFILE_UNLOCK();
         int err = pthread_mutex_unlock(&_mutex);
         CHECK_EQ(err, 0) << ::strerror(err);
     }
 
     bool TryLock() {
-        return pthread_mutex_trylock(&_mutex) == 0;
+        return LOCK_PROFILE_TRY(xx::LOCK_MUTEX, this->RawTryLock());
     }
 
     pthread_mutex_t* mutex() {
@@ -49,8 +128,18 @@ class Mutex {
 private:
     pthread_mutex_t _mutex;
 
+    void RawLock() {
+        int err = pthread_mutex_lock(&_mutex);
+        CHECK_EQ(err, 0)<< ::strerror(err);
+    }
+
+    bool RawTryLock() {
+        return pthread_mutex_trylock(&_mutex) == 0;
+    }
+
     DISALLOW_COPY_AND_ASSIGN(Mutex);
 };
+#endif
 
 class RwLock {
   public:
@@ -58,40 +147,59 @@ class RwLock {
         CHECK(pthread_rwlock_init(&_lock, NULL) == 0);
     }
     ~RwLock() {
+        LOCK_PROFILE_DESTROY();
         CHECK(pthread_rwlock_destroy(&_lock) == 0);
     }
 
     void ReadLock() {
-        int err = pthread_rwlock_rdlock(&_lock);
-        CHECK_EQ(err, 0)<< ::strerror(err);
+        LOCK_PROFILE_LOCK(xx::LOCK_RWLOCK, this->RawTryReadLock(), this->RawReadLock());
     }
 
     void WriteLock() {
-        int err = pthread_rwlock_wrlock(&_lock);
-        CHECK_EQ(err, 0) << ::strerror(err);
+        LOCK_PROFILE_LOCK(xx::LOCK_RWLOCK, this->RawTryWriteLock(), this->RawWriteLock());
     }
 
     void ReadUnLock() {
+        LOCK_PROFILE_UNLOCK();
         int err = pthread_rwlock_unlock(&_lock);
         CHECK_EQ(err, 0) << ::strerror(err);
     }
 
     void WriteUnLock() {
+        LOCK_PROFILE_UNLOCK();
         int err = pthread_rwlock_unlock(&_lock);
         CHECK_EQ(err, 0) << ::strerror(err);
     }
 
     bool TryReadLock() {
-        return pthread_rwlock_tryrdlock(&_lock) == 0;
+        return LOCK_PROFILE_TRY(xx::LOCK_RWLOCK, this->RawTryReadLock());
     }
 
     bool TryWriteLock() {
-        return pthread_rwlock_trywrlock(&_lock) == 0;
+        return LOCK_PROFILE_TRY(xx::LOCK_RWLOCK, this->RawTryWriteLock());
     }
 
 private:
     pthread_rwlock_t _lock;
 
+    void RawReadLock() {
+        int err = pthread_rwlock_rdlock(&_lock);
+        CHECK_EQ(err, 0)<< ::strerror(err);
+    }
+
+    void RawWriteLock() {
+        int err = pthread_rwlock_wrlock(&_lock);
+        CHECK_EQ(err, 0) << ::strerror(err);
+    }
+
+    bool RawTryReadLock() {
+        return pthread_rwlock_tryrdlock(&_lock) == 0;
+    }
+
+    bool RawTryWriteLock() {
+        return pthread_rwlock_trywrlock(&_lock) == 0;
+    }
+
     DISALLOW_COPY_AND_ASSIGN(RwLock);
 };
 
@@ -103,19 +211,22 @@ class Mutex {
     }
 
     ~Mutex() {
+        LOCK_PROFILE_DESTROY();
         ::DeleteCriticalSection(&_mutex);
     }
 
     void Lock() {
-        ::EnterCriticalSection(&_mutex);
+        LOCK_PROFILE_LOCK(xx::LOCK_MUTEX, ::TryEnterCriticalSection(&_mutex) != FALSE,
+                          ::EnterCriticalSection(&_mutex));
     }
 
     void UnLock() {
+        LOCK_PROFILE_UNLOCK();
         ::LeaveCriticalSection(&_mutex);
     }
 
     bool TryLock() {
-        return ::TryEnterCriticalSection(&_mutex) != FALSE;
+        return LOCK_PROFILE_TRY(xx::LOCK_MUTEX, ::TryEnterCriticalSection(&_mutex) != FALSE);
     }
 
     ::CRITICAL_SECTION* mutex() {
@@ -133,30 +244,37 @@ class RwLock {
     RwLock() {
         ::InitializeSRWLock(&_lock);
     }
-    ~RwLock() {}
+    ~RwLock() {
+        LOCK_PROFILE_DESTROY();
+    }
 
     void ReadLock() {
-        ::AcquireSRWLockShared(&_lock);
+        LOCK_PROFILE_LOCK(xx::LOCK_RWLOCK, ::TryAcquireSRWLockShared(&_lock) != FALSE,
+                          ::AcquireSRWLockShared(&_lock));
     }
 
     void WriteLock() {
-        ::AcquireSRWLockExclusive(&_lock);
+        LOCK_PROFILE_LOCK(xx::LOCK_RWLOCK, ::TryAcquireSRWLockExclusive(&_lock) != FALSE,
+                          ::AcquireSRWLockExclusive(&_lock));
     }
 
     void ReadUnLock() {
+        LOCK_PROFILE_UNLOCK();
         ::ReleaseSRWLockShared(&_lock);
     }
 
     void WriteUnLock() {
+        LOCK_PROFILE_UNLOCK();
         ::ReleaseSRWLockExclusive(&_lock);
     }
 
     bool TryReadLock() {
-        return ::TryAcquireSRWLockShared(&_lock) != FALSE;
+        return LOCK_PROFILE_TRY(xx::LOCK_RWLOCK, ::TryAcquireSRWLockShared(&_lock) != FALSE);
     }
 
     bool TryWriteLock() {
-        return ::TryAcquireSRWLockExclusive(&_lock) != FALSE;
+        return LOCK_PROFILE_TRY(xx::LOCK_RWLOCK,
+                                ::TryAcquireSRWLockExclusive(&_lock) != FALSE);
     }
 
   private:
@@ -235,7 +353,113 @@ class ScopedTryLock {
 };
 
 /************************ SyncEvent & Condition Variable **********************/
-#ifndef _WIN32
+#if defined(__linux__) && defined(USE_FUTEX)
+class SyncEvent {
+  public:
+    explicit SyncEvent(bool manual_reset = true, bool signaled = false)
+        : _manual_reset(manual_reset), _signaled(signaled), _waiters(0) {
+    }
+
+    ~SyncEvent() {
+    }
+
+    void Notify() {
+        if (__atomic_load_n(&_signaled, __ATOMIC_RELAXED) != 0) return;
+        if (__atomic_exchange_n(&_signaled, 1, __ATOMIC_SEQ_CST) != 0) return;
+        if (__atomic_load_n(&_waiters, __ATOMIC_SEQ_CST) != 0) {
+            xx::FutexWake(&_signaled, _manual_reset ? 0x7fffffff : 1);
+        }
+    }
+
+    void Reset() {
+        __atomic_store_n(&_signaled, 0, __ATOMIC_RELAXED);
+    }
+
+    bool Signaled() {
+        return __atomic_load_n(&_signaled, __ATOMIC_ACQUIRE) != 0;
+    }
+
+    void Wait() {
+        if (this->Consume()) return;
+        __atomic_add_fetch(&_waiters, 1, __ATOMIC_SEQ_CST);
+        while (!this->Consume()) xx::FutexWait(&_signaled, 0);
+        __atomic_sub_fetch(&_waiters, 1, __ATOMIC_RELAXED);
+    }
+
+    // return false if timeout
+    bool TimedWait(uint32 ms);
+
+  private:
+    const bool _manual_reset;
+    uint32 _signaled;
+    uint32 _waiters;
+
+    // true if signaled, reset it for auto-reset events
+    bool Consume() {
+        if (_manual_reset) return this->Signaled();
+        uint32 v = 1;
+        return __atomic_compare_exchange_n(&_signaled, &v, 0, false,
+                                           __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+
+    DISALLOW_COPY_AND_ASSIGN(SyncEvent);
+};
+
+/*
+ * NotifyAll() wakes up one waiter and moves the others to the futex of the
+ * mutex, where they are woken up one by one as the mutex is unlocked.
+ */
+class Condition {
+  public:
+    Condition()
+        : _seq(0), _waiters(0), _mutex(NULL) {
+    }
+
+    ~Condition() {
+    }
+
+    void Notify() {
+        __atomic_add_fetch(&_seq, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&_waiters, __ATOMIC_SEQ_CST) != 0) {
+            xx::FutexWake(&_seq, 1);
+        }
+    }
+
+    void NotifyAll();
+
+    void Wait(Mutex& mutex) {
+        ScopedTryLock m(mutex);
+        uint32 seq = this->Prepare(mutex);
+        xx::FutexWait(&_seq, seq);
+        this->Finish(mutex);
+    }
+
+    // return false if timeouot
+    bool TimedWait(Mutex& mutex, uint32 ms);
+
+  private:
+    uint32 _seq;
+    uint32 _waiters;
+    Mutex* _mutex;
+
+    // called with the mutex locked, return the sequence to wait on
+    uint32 Prepare(Mutex& mutex) {
+        __atomic_store_n(&_mutex, &mutex, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&_waiters, 1, __ATOMIC_SEQ_CST);
+        uint32 seq = __atomic_load_n(&_seq, __ATOMIC_SEQ_CST);
+        mutex.UnLock();
+        return seq;
+    }
+
+    void Finish(Mutex& mutex) {
+        __atomic_sub_fetch(&_waiters, 1, __ATOMIC_RELAXED);
+        mutex.Relock();
+    }
+
+    DISALLOW_COPY_AND_ASSIGN(Condition);
+};
+
+#elif !defined(_WIN32)
 class SyncEvent {
   public:
     explicit SyncEvent(bool manual_reset = true, bool signaled = false);
@@ -391,6 +615,33 @@ class Condition {
 #endif
 
 /************************************ Thread **********************************/
+/*
+ * ThreadOptions: attributes of a new thread, for Start(const ThreadOptions&).
+ *
+ *   ThreadOptions opt;
+ *   opt.cpus.push_back(3);         // pin to cpu 3, see cpu_topology.h
+ *   opt.stack_size = 64 << 10;
+ *   opt.name = "io-worker";        // shown in top -H and perf
+ *   opt.sched_policy = SCHED_FIFO;
+ *   opt.sched_priority = 10;
+ *   t.Start(opt);
+ *
+ *   Settings not supported on the platform are ignored.
+ */
+struct ThreadOptions {
+    ThreadOptions()
+        : numa_node(-1), stack_size(0), sched_policy(-1), sched_priority(0) {
+    }
+
+    std::vector<int> cpus;     // cpu affinity, empty for all cpus
+    int numa_node;             // run on cpus of the node and prefer its memory,
+                               // -1 for no binding
+    uint32 stack_size;         // in bytes, 0 for the default
+    std::string name;          // linux keeps the first 15 characters
+    int sched_policy;          // SCHED_OTHER, SCHED_FIFO, SCHED_RR..., -1 to inherit
+    int sched_priority;
+};
+
 #ifndef _WIN32
 class Thread {
   public:
@@ -413,9 +664,13 @@ class Thread {
 
     bool Start() {
         CHECK(_c != NULL);
-        return pthread_create(&_id, 0, &Thread::Run, (void*) _c.get()) == 0;
+        return pthread_create(&_id, 0, &Thread::Run, (void*) this) == 0;
     }
 
+    // return false if the thread can't be created with the options,
+    // e.g. no permission for a realtime policy.
+    bool Start(const ThreadOptions& options);
+
     void Join() {
         if (_id != 0) {
             pthread_join(_id, NULL);
@@ -441,12 +696,17 @@ class Thread {
   private:
     scoped_ptr<Closure> _c;
     pthread_t _id;
+    scoped_ptr<ThreadOptions> _opt;   // applied by the new thread itself
 
     DISALLOW_COPY_AND_ASSIGN(Thread);
 
+    // set name and memory policy of the current thread
+    static void Init(const ThreadOptions& opt);
+
     static void* Run(void* p) {
-        Closure* c = (Closure*) p;
-        c->Run();
+        Thread* t = (Thread*) p;
+        if (t->_opt != NULL) Thread::Init(*t->_opt);
+        t->_c->Run();
         return NULL;
     }
 };
@@ -477,6 +737,23 @@ class Thread {
         return _h != INVALID_HANDLE_VALUE;
     }
 
+    // only stack_size and cpus (the first 64) are used on windows
+    bool Start(const ThreadOptions& options) {
+        CHECK(_c != NULL);
+        _h = ::CreateThread(NULL, options.stack_size, &Thread::Run,
+                            (void*) _c.get(), CREATE_SUSPENDED, NULL);
+        if (_h == INVALID_HANDLE_VALUE) return false;
+
+        ::DWORD_PTR mask = 0;
+        for (::size_t i = 0; i < options.cpus.size(); ++i) {
+            if (options.cpus[i] < 64) mask |= (::DWORD_PTR) 1 << options.cpus[i];
+        }
+        if (mask != 0) ::SetThreadAffinityMask(_h, mask);
+
+        ::ResumeThread(_h);
+        return true;
+    }
+
     void Join() {
         if (_h != INVALID_HANDLE_VALUE) {
             ::WaitForSingleObject(_h, INFINITE);
@@ -510,47 +787,123 @@ private:
 };
 #endif
 
+/*
+ * StoppableThread: run the closure again and again until Stop() is called.
+ *
+ *   By default the closure is run back-to-back. With SetInterval(), the thread
+ *   waits between two rounds, and the wait ends at once on Wake() or Stop().
+ *   If max_backoff_ms > 0, a round in which the closure calls Idle() makes the
+ *   next wait grow exponentially, with jitter, up to max_backoff_ms. A round
+ *   without Idle() resets the wait to the interval.
+ *
+ *   StoppableThread st(&obj, &T::poll);
+ *   st.SetInterval(10, 1000);   // 10ms, up to 1s when T::poll() calls st.Idle()
+ *   st.Start();
+ *   st.Wake();                  // run T::poll() now
+ *   st.Stop();
+ */
 class StoppableThread {
   public:
     explicit StoppableThread(Closure* c)
         : _t(NewPermanentCallback(this, &StoppableThread::Run)), _c(c),
-          _stop(false) {
+          _ev(false, false), _interval_ms(0), _max_backoff_ms(0),
+          _backoff_ms(0), _idle(false), _seed(0) {
     }
 
     template<typename ... A>
     StoppableThread(void (*f)(A ...), A ... a)
         : _t(NewPermanentCallback(this, &StoppableThread::Run)),
-          _c(NewPermanentCallback(f, a...)), _stop(false) {
+          _c(NewPermanentCallback(f, a...)), _ev(false, false),
+          _interval_ms(0), _max_backoff_ms(0), _backoff_ms(0), _idle(false),
+          _seed(0) {
     }
 
     template<typename T, typename ... A>
     StoppableThread(T* obj, void (T::*f)(A ...), A ... a)
         : _t(NewPermanentCallback(this, &StoppableThread::Run)),
-          _c(NewPermanentCallback(obj, f, a...)), _stop(false) {
+          _c(NewPermanentCallback(obj, f, a...)), _ev(false, false),
+          _interval_ms(0), _max_backoff_ms(0), _backoff_ms(0), _idle(false),
+          _seed(0) {
     }
 
     ~StoppableThread() {
     }
 
+    // call before Start()
+    void SetInterval(uint32 interval_ms, uint32 max_backoff_ms = 0) {
+        _interval_ms = interval_ms;
+        _max_backoff_ms = max_backoff_ms;
+    }
+
     bool Start() {
         CHECK(_c != NULL);
         return _t.Start();
     }
 
+    bool Start(const ThreadOptions& options) {
+        CHECK(_c != NULL);
+        return _t.Start(options);
+    }
+
     void Stop() {
-        if (_stop) return;
-        _stop = true;
+        if (!_stop.CompareSwap(0, 1)) return;
+        _ev.Notify();
         _t.Join();
     }
 
+    // end the current wait, or skip the next one
+    void Wake() {
+        _ev.Notify();
+    }
+
+    // called by the closure: this round did no work
+    void Idle() {
+        _idle = true;
+    }
+
   private:
     Thread _t;
     scoped_ptr<Closure> _c;
-    bool _stop;
+    atomic_t _stop;
+    SyncEvent _ev;
+
+    uint32 _interval_ms;
+    uint32 _max_backoff_ms;
+    uint32 _backoff_ms;
+    bool _idle;
+    uint32 _seed;
+
+    // wait time after this round
+    uint32 NextWait() {
+        if (!_idle || _max_backoff_ms == 0) {
+            _backoff_ms = 0;
+            return _interval_ms;
+        }
+
+        if (_backoff_ms == 0) {
+            _backoff_ms = _interval_ms > 0 ? _interval_ms : 1;
+        } else if (_backoff_ms < _max_backoff_ms) {
+            _backoff_ms = _backoff_ms * 2;
+        }
+        if (_backoff_ms > _max_backoff_ms) _backoff_ms = _max_backoff_ms;
+
+        // xorshift, wait in [backoff / 2, backoff]
+        if (_seed == 0) _seed = static_cast<uint32>(reinterpret_cast<uintptr_t>(this)) | 1;
+        _seed ^= _seed << 13;
+        _seed ^= _seed >> 17;
+        _seed ^= _seed << 5;
+
+        uint32 half = _backoff_ms / 2;
+        return _backoff_ms - half + _seed % (half + 1);
+    }
 
     void Run() {
-        while (!_stop) {
+        while (_stop.value() == 0) {
+            _idle = false;
             _c->Run();
+
+            uint32 ms = this->NextWait();
+            if (ms > 0 && _stop.value() == 0) _ev.TimedWait(ms);
         }
     }
 };
@@ -558,16 +911,21 @@ class StoppableThread {
 class AutoThread {
   public:
     static void NewAutoThread(Closure* c) {
-        (void) new AutoThread(c);
+        (void) new AutoThread(c, NULL);
+    }
+
+    static void NewAutoThread(Closure* c, const ThreadOptions& options) {
+        (void) new AutoThread(c, &options);
     }
 
   private:
     Thread _t;
     scoped_ptr<Closure> _c;
 
-    explicit AutoThread(Closure* c)
+    AutoThread(Closure* c, const ThreadOptions* options)
         : _t(NewPermanentCallback(this, &AutoThread::Run)), _c(c) {
-        CHECK(_c != NULL && _t.Start());
+        CHECK(_c != NULL);
+        CHECK(options != NULL ? _t.Start(*options) : _t.Start());
     }
     ~AutoThread() {
     }
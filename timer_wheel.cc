@@ -0,0 +1,276 @@
+#include "timer_wheel.h"
+
+// list helpers, T is TimerWheel::Timer
+template<typename T>
+static inline void ListInit(T* head) {
+    head->prev = head->next = head;
+}
+
+template<typename T>
+static inline bool ListEmpty(const T* head) {
+    return head->next == head;
+}
+
+template<typename T>
+static inline void ListAdd(T* head, T* t) {
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+template<typename T>
+static inline void ListDel(T* t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
+
+// move all nodes of list from to list to
+template<typename T>
+static inline void ListMove(T* from, T* to) {
+    ListInit(to);
+    if (ListEmpty(from)) return;
+
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    ListInit(from);
+}
+
+TimerWheel::TimerWheel(uint32 tick_ms, Executor* executor)
+    : _tick_us(static_cast<uint64>(tick_ms > 0 ? tick_ms : 1) * 1000),
+      _base_us(NowInUs()), _executor(executor), _ev(false, false),
+      _t(this, &TimerWheel::Loop), _tick(0), _next_id(0) {
+    for (int i = 0; i < ROOT_SIZE; ++i) {
+        ListInit(&_root[i]);
+    }
+
+    for (int l = 0; l < LEVELS - 1; ++l) {
+        for (int i = 0; i < LEVEL_SIZE; ++i) {
+            ListInit(&_levels[l][i]);
+        }
+    }
+}
+
+TimerWheel::~TimerWheel() {
+    this->Stop();
+
+    typedef std::unordered_map<uint64, Timer*>::iterator Iter;
+    for (Iter it = _timers.begin(); it != _timers.end(); ++it) {
+        Timer* t = it->second;
+        if (t->running) continue;  // owned by Fire() on the executor
+        delete t->c;
+        delete t;
+    }
+    _timers.clear();
+}
+
+bool TimerWheel::Start() {
+    return _t.Start();
+}
+
+void TimerWheel::Stop() {
+    if (!_stop.CompareSwap(0, 1)) return;
+    _ev.Notify();
+    _t.Join();
+}
+
+uint64 TimerWheel::RunAt(uint64 us, Closure* c) {
+    return this->NewTimer(this->TickOf(us), 0, c);
+}
+
+uint64 TimerWheel::RunEvery(uint32 ms, Closure* c) {
+    uint64 us = static_cast<uint64>(ms) * 1000;
+    uint64 interval = (us + _tick_us - 1) / _tick_us;
+    if (interval == 0) interval = 1;
+
+    return this->NewTimer(this->TickOf(NowInUs() + us),
+                          static_cast<uint32>(interval), c);
+}
+
+uint64 TimerWheel::NewTimer(uint64 expire, uint32 interval, Closure* c) {
+    Timer* t = new Timer;
+    t->expire = expire;
+    t->interval = interval;
+    t->running = false;
+    t->cancelled = false;
+    t->c = c;
+
+    uint64 id;
+    bool was_empty;
+    {
+        ScopedMutex m(_mutex);
+        was_empty = _timers.empty();
+
+        // the driver sleeps without ticking while the wheel is empty
+        if (was_empty) {
+            uint64 now = this->NowTick();
+            if (_tick < now) _tick = now;
+        }
+
+        id = t->id = ++_next_id;
+        _timers[id] = t;
+        this->Link(t);
+    }
+
+    // t may have fired and been deleted already
+    if (was_empty) _ev.Notify();
+    return id;
+}
+
+bool TimerWheel::Cancel(uint64 id) {
+    Timer* t = NULL;
+    {
+        ScopedMutex m(_mutex);
+        std::unordered_map<uint64, Timer*>::iterator it = _timers.find(id);
+        if (it == _timers.end()) return false;
+
+        t = it->second;
+        _timers.erase(it);
+
+        // periodic timer being run, Fire() will delete it
+        if (t->running) {
+            t->cancelled = true;
+            return true;
+        }
+
+        ListDel(t);
+    }
+
+    delete t->c;
+    delete t;
+    return true;
+}
+
+uint32 TimerWheel::size() {
+    ScopedMutex m(_mutex);
+    return static_cast<uint32>(_timers.size());
+}
+
+void TimerWheel::Link(Timer* t) {
+    uint64 expire = t->expire;
+
+    if (expire < _tick) {
+        ListAdd(&_root[_tick & (ROOT_SIZE - 1)], t);
+        return;
+    }
+
+    uint64 delta = expire - _tick;
+    if (delta < ROOT_SIZE) {
+        ListAdd(&_root[expire & (ROOT_SIZE - 1)], t);
+        return;
+    }
+
+    // too far away, park it in the farthest slot of the last level
+    const uint64 max_delta = (1ULL << (ROOT_BITS + (LEVELS - 1) * LEVEL_BITS)) - 1;
+    if (delta > max_delta) expire = _tick + max_delta;
+
+    for (int l = 0; l < LEVELS - 1; ++l) {
+        int shift = ROOT_BITS + l * LEVEL_BITS;
+        if (delta < (1ULL << (shift + LEVEL_BITS)) || l == LEVELS - 2) {
+            ListAdd(&_levels[l][(expire >> shift) & (LEVEL_SIZE - 1)], t);
+            return;
+        }
+    }
+}
+
+void TimerWheel::Cascade(int level, uint32 index) {
+    Timer list;
+    ListMove(&_levels[level][index], &list);
+
+    while (!ListEmpty(&list)) {
+        Timer* t = list.next;
+        ListDel(t);
+        this->Link(t);
+    }
+}
+
+void TimerWheel::Advance(uint64 tick, std::vector<Timer*>* expired) {
+    if (_timers.empty()) {
+        if (_tick <= tick) _tick = tick + 1;
+        return;
+    }
+
+    for (; _tick <= tick; ++_tick) {
+        uint32 index = static_cast<uint32>(_tick & (ROOT_SIZE - 1));
+
+        // the root wraps around, pull timers down from the upper levels
+        for (int l = 0; index == 0 && l < LEVELS - 1; ++l) {
+            int shift = ROOT_BITS + l * LEVEL_BITS;
+            index = static_cast<uint32>((_tick >> shift) & (LEVEL_SIZE - 1));
+            this->Cascade(l, index);
+        }
+
+        Timer* head = &_root[_tick & (ROOT_SIZE - 1)];
+        while (!ListEmpty(head)) {
+            Timer* t = head->next;
+            ListDel(t);
+
+            if (t->interval == 0) {
+                _timers.erase(t->id);
+            } else {
+                t->running = true;
+            }
+            expired->push_back(t);
+        }
+    }
+}
+
+void TimerWheel::Fire(Timer* t) {
+    if (t->interval == 0) {
+        t->c->Run();
+        delete t;
+        return;
+    }
+
+    t->c->Run();
+
+    ScopedMutex m(_mutex);
+    if (t->cancelled) {
+        delete t->c;
+        delete t;
+        return;
+    }
+
+    // skip the missed rounds if the closure runs longer than the interval
+    t->running = false;
+    t->expire += t->interval;
+    if (t->expire < _tick) t->expire = _tick;
+    this->Link(t);
+}
+
+void TimerWheel::Loop() {
+    std::vector<Timer*> expired;
+
+    while (_stop.value() == 0) {
+        bool empty;
+        uint64 next_us;
+        {
+            ScopedMutex m(_mutex);
+            this->Advance(this->NowTick(), &expired);
+            empty = _timers.empty();
+            next_us = _base_us + _tick * _tick_us;
+        }
+
+        for (::size_t i = 0; i < expired.size(); ++i) {
+            if (_executor != NULL) {
+                _executor->Post(NewCallback(this, &TimerWheel::Fire, expired[i]));
+            } else {
+                this->Fire(expired[i]);
+            }
+        }
+        expired.clear();
+
+        if (empty) {
+            _ev.Wait();
+            continue;
+        }
+
+        uint64 now = NowInUs();
+        if (next_us > now) {
+            _ev.TimedWait(static_cast<uint32>((next_us - now + 999) / 1000));
+        }
+    }
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "data_types.h"
+#include "atomic.h"
+#include "executor.h"
+#include "thread_util.h"
+#include "time_util.h"
+
+#include <unordered_map>
+#include <vector>
+
+/*
+ * TimerWheel: hierarchical timing wheel driven by NowInUs().
+ *
+ *   4 levels of slots (256, 64, 64, 64) cover 2^26 ticks. Timers further away
+ *   stay in the last level and are cascaded again until they are close enough.
+ *   Insert and cancel are O(1), and every pending timer costs one node.
+ *
+ *   One driver thread advances the wheel every tick. Closures run on the driver
+ *   thread, or are posted to the executor if one is given.
+ *
+ *   Ownership of closures:
+ *     RunAt/RunAfter:  c is run once. create it with NewCallback(), it is
+ *                      deleted by the wheel if cancelled before it runs.
+ *     RunEvery:        c is run repeatedly. create it with NewPermanentCallback(),
+ *                      the wheel deletes it when the timer is cancelled.
+ *
+ *   TimerWheel tw;
+ *   tw.Start();
+ *   uint64 id = tw.RunAfter(50, NewCallback(&fun));
+ *   tw.RunEvery(1000, NewPermanentCallback(&obj, &T::world, 7));
+ *   tw.Cancel(id);
+ *   tw.Stop();
+ */
+class TimerWheel {
+  public:
+    // tick_ms: resolution of the wheel, timers never fire before the deadline.
+    explicit TimerWheel(uint32 tick_ms = 1, Executor* executor = NULL);
+
+    // call Stop(), and delete closures of pending timers.
+    ~TimerWheel();
+
+    bool Start();
+
+    // pending timers are dropped. if an executor is used, closures already
+    // posted to it must finish before the wheel is destroyed.
+    void Stop();
+
+    // return id of the timer, 0 is never used.
+    // us: deadline in NowInUs() time.
+    uint64 RunAt(uint64 us, Closure* c);
+
+    uint64 RunAfter(uint32 ms, Closure* c) {
+        return this->RunAt(NowInUs() + static_cast<uint64>(ms) * 1000, c);
+    }
+
+    uint64 RunEvery(uint32 ms, Closure* c);
+
+    // return false if the timer is not found, or a one-shot timer has fired.
+    bool Cancel(uint64 id);
+
+    // number of pending timers
+    uint32 size();
+
+  private:
+    struct Timer {
+        Timer* prev;
+        Timer* next;
+        uint64 id;
+        uint64 expire;        // in ticks
+        uint32 interval;      // in ticks, 0 for one-shot timers
+        bool running;         // a periodic timer out of the wheel
+        bool cancelled;
+        Closure* c;
+    };
+
+    enum {
+        ROOT_BITS = 8,
+        LEVEL_BITS = 6,
+        LEVELS = 4,
+        ROOT_SIZE = 1 << ROOT_BITS,
+        LEVEL_SIZE = 1 << LEVEL_BITS,
+    };
+
+    const uint64 _tick_us;
+    const uint64 _base_us;
+    Executor* _executor;
+
+    Mutex _mutex;
+    SyncEvent _ev;
+    Thread _t;
+    atomic_t _stop;
+
+    uint64 _tick;             // next tick to process
+    uint64 _next_id;
+    std::unordered_map<uint64, Timer*> _timers;
+    Timer _root[ROOT_SIZE];                 // heads of circular lists
+    Timer _levels[LEVELS - 1][LEVEL_SIZE];
+
+    // the first tick not earlier than us
+    uint64 TickOf(uint64 us) const {
+        return us > _base_us ? (us - _base_us + _tick_us - 1) / _tick_us : 0;
+    }
+
+    // the tick we are in now
+    uint64 NowTick() const {
+        return (NowInUs() - _base_us) / _tick_us;
+    }
+
+    uint64 NewTimer(uint64 expire, uint32 interval, Closure* c);
+    void Link(Timer* t);
+    void Cascade(int level, uint32 index);
+    void Advance(uint64 tick, std::vector<Timer*>* expired);
+    void Fire(Timer* t);
+    void Loop();
+
+    DISALLOW_COPY_AND_ASSIGN(TimerWheel);
+};